@@ -0,0 +1,16 @@
+QT += core gui
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = GeneticBenchmark
+CONFIG += console
+CONFIG += link_pkgconfig
+CONFIG += c++11
+
+TEMPLATE = app
+
+SOURCES += benchmark.cpp
+
+include(GeneticEngine.pri)
+
+PKGCONFIG += opencv
@@ -0,0 +1,42 @@
+# Everything but main(), shared by GeneticEngine.pro and GeneticBenchmark.pro
+
+SOURCES += \
+    genetictree.cpp \
+    geneticengine.cpp \
+    geneticprogram.cpp \
+    tileevaluator.cpp \
+    genetickernels.cpp \
+    geneticjit.cpp \
+    workstealingpool.cpp \
+    genomearena.cpp \
+    fitnesscache.cpp \
+    subtreecache.cpp \
+    geneticisland.cpp \
+    migrationchannel.cpp \
+    checkpoint.cpp \
+    trainingset.cpp \
+    deploypipeline.cpp \
+    geneticmetrics.cpp \
+    resultslog.cpp
+
+HEADERS += \
+    genetictree.h \
+    geneticengine.h \
+    geneticprogram.h \
+    tileevaluator.h \
+    genetickernels.h \
+    genetickernels_simd.h \
+    geneticjit.h \
+    workstealingpool.h \
+    boundedselection.h \
+    genomearena.h \
+    fitnesscache.h \
+    subtreecache.h \
+    geneticisland.h \
+    migrationchannel.h \
+    geneticrandom.h \
+    checkpoint.h \
+    trainingset.h \
+    deploypipeline.h \
+    geneticmetrics.h \
+    resultslog.h
@@ -9,15 +9,8 @@ CONFIG += c++11
 
 TEMPLATE = app
 
-SOURCES += main.cpp \
-    genetictree.cpp \
-    geneticengine.cpp \
-    geneticprogram.cpp
+SOURCES += main.cpp
 
-PKGCONFIG += opencv
-
-HEADERS += \
-    genetictree.h \
-    geneticengine.h \
-    geneticprogram.h
+include(GeneticEngine.pri)
 
+PKGCONFIG += opencv
@@ -0,0 +1,362 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QThread>
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include "geneticengine.h"
+#include "genetickernels.h"
+#include "geneticjit.h"
+
+// Times the engine's hot paths on synthetic images and prints one JSON
+// object per case and line to stdout, so runs can be diffed between
+// releases. Progress and warnings go to stderr.
+
+using namespace cv;
+
+namespace {
+
+struct Parameter {
+    const char *name;
+    double value;
+};
+
+typedef std::vector<Parameter> Parameters;
+
+class Benchmark
+{
+public:
+    Benchmark(qint64 minimumNanoseconds, const QString &filter) :
+        minimumNanoseconds(minimumNanoseconds),
+        filter(filter)
+    {
+    }
+
+    bool enabled(const QString &name) const
+    {
+        return filter.isEmpty() || name.contains(filter);
+    }
+
+    // Runs setup, untimed, then body until minimumNanoseconds are spent
+    // in body and at least three samples are taken. items is the work done
+    // by one body call, e.g. pixels, for a throughput figure.
+    void measure(const QString &name, const Parameters &parameters, double items,
+                 const std::function<void()> &setup, const std::function<void()> &body)
+    {
+        std::vector<qint64> samples;
+        qint64 total = 0;
+        QElapsedTimer timer;
+
+        while (total < minimumNanoseconds || samples.size() < 3) {
+            setup();
+            timer.start();
+            body();
+            samples.push_back(timer.nsecsElapsed());
+            total += samples.back();
+        }
+
+        std::sort(samples.begin(), samples.end());
+        const double mean = double(total) / samples.size();
+
+        Parameters fields = parameters;
+        fields.push_back({ "iterations", double(samples.size()) });
+        fields.push_back({ "mean_ns", mean });
+        fields.push_back({ "median_ns", double(samples[samples.size() / 2]) });
+        fields.push_back({ "min_ns", double(samples.front()) });
+        if (items > 0)
+            fields.push_back({ "items_per_second", items * 1e9 / mean });
+
+        report(name, fields);
+    }
+
+    static void report(const QString &name, const Parameters &fields)
+    {
+        QString line = "{\"name\":\"" + name + "\"";
+        for (const auto& field : fields)
+            line += QString(",\"%1\":%2").arg(field.name).arg(QString::number(field.value, 'g', 12));
+        line += "}";
+
+        printf("%s\n", qPrintable(line));
+        fflush(stdout);
+    }
+
+private:
+    const qint64 minimumNanoseconds;
+    const QString filter;
+};
+
+// Horizontal and vertical ramps with a noisy red channel, the same for a
+// seed on every machine
+Mat syntheticImage(int size, quint64 seed)
+{
+    GeneticRandom random(seed);
+    Mat image(size, size, CV_8UC3);
+
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            Vec3b &pixel = image.at<Vec3b>(y, x);
+            pixel[0] = uchar(x * 255 / size);
+            pixel[1] = uchar(y * 255 / size);
+            pixel[2] = uchar(random.bounded(256));
+        }
+    }
+
+    return image;
+}
+
+// Trees grow to a random depth below the maximum, so a few are drawn and
+// the deepest kept
+void growTree(GeneticTree &tree, int depth, GeneticRandom &random)
+{
+    GeneticTree candidate;
+    candidate.maxInitialDepth = depth;
+    tree.code.clear();
+
+    for (int i = 0; i < 8; ++i) {
+        candidate.generateTree(random);
+        if (tree.code.empty() || candidate.depthOfTree() > tree.depthOfTree())
+            tree.code = candidate.code;
+    }
+}
+
+void messageHandler(QtMsgType type, const QMessageLogContext &, const QString &message)
+{
+    // The engine's own progress output would drown the results
+    if (type != QtDebugMsg)
+        fprintf(stderr, "%s\n", qPrintable(message));
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication application(argc, argv);
+    qInstallMessageHandler(messageHandler);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Times the engine's hot paths on synthetic images, one JSON object per line.");
+    parser.addHelpOption();
+    parser.addOptions({
+        { "filter", "Only run cases whose name contains this text.", "text" },
+        { "min-time", "Milliseconds spent on each case at least.", "ms", "200" },
+        { "generations", "Generations timed per engine run.", "count", "3" },
+        { "quick", "Smaller sizes and fewer configurations, for a smoke test." }
+    });
+    parser.process(application);
+
+    const bool quick = parser.isSet("quick");
+    const int generations = qMax(1, parser.value("generations").toInt());
+    Benchmark benchmark(qint64(qMax(1, parser.value("min-time").toInt())) * 1000000, parser.value("filter"));
+
+    const std::vector<int> depths = quick ? std::vector<int>{ 4, 12 } : std::vector<int>{ 4, 8, 12, 16, 20 };
+    const std::vector<int> sizes = quick ? std::vector<int>{ 64, 256 } : std::vector<int>{ 64, 256, 1024 };
+    const std::vector<int> populations = quick ? std::vector<int>{ 50 } : std::vector<int>{ 50, 200, 800 };
+    std::vector<int> threadCounts = { 1, 2, 4 };
+    if (!quick && QThread::idealThreadCount() > 4)
+        threadCounts.push_back(QThread::idealThreadCount());
+    else if (quick)
+        threadCounts = { 1, QThread::idealThreadCount() };
+
+    Benchmark::report("machine", {
+        { "cores", double(QThread::idealThreadCount()) },
+        { "kernel_isa", double(GeneticKernels::table().isa) },
+        { "jit", double(GeneticJit::isSupported()) }
+    });
+
+    // Every supported instruction set, not only the one the engine picks
+    if (benchmark.enabled("kernels.throughput")) {
+        fprintf(stderr, "kernels.throughput\n");
+        for (const auto& throughput : GeneticKernels::benchmark()) {
+            Benchmark::report("kernels.throughput", { { "isa", double(throughput.isa) },
+                                                       { "items_per_second", throughput.pixelsPerSecond } });
+        }
+    }
+
+    GeneticRandom random(1);
+
+    if (benchmark.enabled("tree.evaluate")) {
+        for (int size : sizes) {
+            Mat planes[3];
+            split(syntheticImage(size, 1), planes);
+
+            for (int depth : depths) {
+                GeneticTree tree;
+                growTree(tree, depth, random);
+                tree.setMatrix(planes[0]);
+
+                fprintf(stderr, "tree.evaluate depth %d size %d\n", depth, size);
+                benchmark.measure("tree.evaluate", { { "depth", double(depth) }, { "size", double(size) },
+                                                     { "nodes", double(tree.code.size()) }, { "height", double(tree.depthOfTree()) } },
+                                  double(size) * size, [](){}, [&]() { tree.evaluateTree(); });
+            }
+        }
+    }
+
+    if (benchmark.enabled("tree.breed") || benchmark.enabled("tree.mutate") || benchmark.enabled("tree.item_copy")) {
+        for (int depth : depths) {
+            // No matrices, so only genome work is timed
+            GeneticTree mother, father, work;
+            growTree(mother, depth, random);
+            growTree(father, depth, random);
+            const Parameters parameters = { { "depth", double(depth) }, { "nodes", double(mother.code.size()) },
+                                            { "height", double(mother.depthOfTree()) } };
+
+            fprintf(stderr, "tree depth %d\n", depth);
+
+            if (benchmark.enabled("tree.breed")) {
+                benchmark.measure("tree.breed", parameters, 0, [](){}, [&]() {
+                    delete mother.breedWithTree(&father, random);
+                });
+            }
+
+            if (benchmark.enabled("tree.mutate")) {
+                benchmark.measure("tree.mutate", parameters, 0, [&]() { work = mother; }, [&]() {
+                    work.mutateRandomChild(&work, random);
+                });
+            }
+
+            if (benchmark.enabled("tree.item_copy")) {
+                GeneticTree::GeneticTreeItem *root = GeneticTree::decode(mother.code);
+                benchmark.measure("tree.item_copy", parameters, 0, [](){}, [&]() {
+                    GeneticTree::GeneticTreeItem copy; // Freed again, deep as well
+                    copy = *root;
+                });
+                delete root;
+            }
+        }
+    }
+
+    const struct {
+        const char *name;
+        GeneticProgram::EvaluationMode mode;
+    } modes[] = {
+        { "program.evaluate.reference", GeneticProgram::ReferenceEvaluation },
+        { "program.evaluate.tiled", GeneticProgram::TiledEvaluation },
+        { "program.evaluate.jit", GeneticProgram::JitEvaluation }
+    };
+
+    if (benchmark.enabled(modes[0].name) || benchmark.enabled(modes[1].name) || benchmark.enabled(modes[2].name)) {
+        for (int size : sizes) {
+            GeneticProgram program;
+            program.setMatrix(syntheticImage(size, 2));
+            program.setMaxInitialDepth(12);
+            program.generateGenome(random);
+
+            for (const auto& mode : modes) {
+                if (!benchmark.enabled(mode.name))
+                    continue;
+
+                program.setEvaluationMode(mode.mode);
+                fprintf(stderr, "%s size %d\n", mode.name, size);
+                benchmark.measure(mode.name, { { "size", double(size) } }, double(size) * size,
+                                  [](){}, [&]() { program.evaluate(); });
+            }
+        }
+    }
+
+    const GeneticKernels::Precision precisions[] = { GeneticKernels::Float32, GeneticKernels::Float16, GeneticKernels::Fixed16 };
+    QStringList precisionCases;
+    for (const auto& precision : precisions) {
+        if (benchmark.enabled("program.score." + GeneticKernels::precisionName(precision)))
+            precisionCases << GeneticKernels::precisionName(precision);
+    }
+
+    if (!precisionCases.isEmpty()) {
+        for (int size : sizes) {
+            const Mat image = syntheticImage(size, 4);
+            Mat targetImage;
+            image.convertTo(targetImage, -1, 0.5, 40);
+
+            Mat inputPlanes[3];
+            Mat targetPlanes[3];
+            GeneticProgram::splitPlanes(image, inputPlanes);
+            GeneticProgram::splitPlanes(targetImage, targetPlanes);
+
+            GeneticProgram program;
+            program.setPlanes(inputPlanes);
+            program.setMaxInitialDepth(12);
+            program.setEvaluationMode(GeneticProgram::TiledEvaluation);
+            program.generateGenome(random);
+
+            const qreal infinity = std::numeric_limits<qreal>::infinity();
+            const qreal exact = program.score(std::vector<Mat>(inputPlanes, inputPlanes + 3),
+                                              std::vector<Mat>(targetPlanes, targetPlanes + 3));
+
+            for (const auto& precision : precisions) {
+                if (!precisionCases.contains(GeneticKernels::precisionName(precision)))
+                    continue;
+
+                std::vector<Mat> inputs;
+                std::vector<Mat> targets;
+                for (int i = 0; i < 3; ++i) {
+                    inputs.push_back(GeneticKernels::pack(inputPlanes[i], precision));
+                    targets.push_back(GeneticKernels::pack(targetPlanes[i], precision));
+                }
+
+                // Percent of full scale, like the engine's errors
+                const qreal difference = qAbs(program.score(inputs, targets, infinity, 0, precision) - exact) / 255 * 100;
+                const QString name = "program.score." + GeneticKernels::precisionName(precision);
+
+                fprintf(stderr, "%s size %d\n", qPrintable(name), size);
+                benchmark.measure(name, { { "size", double(size) }, { "error_difference", difference } }, 3.0 * size * size,
+                                  [](){}, [&]() { program.score(inputs, targets, infinity, 0, precision); });
+            }
+        }
+    }
+
+    if (benchmark.enabled("engine.generation")) {
+        const int size = quick ? 64 : 256;
+        const Mat input = syntheticImage(size, 3);
+        Mat target;
+        input.convertTo(target, -1, 0.5, 40);
+
+        for (int population : populations) {
+            for (int threads : threadCounts) {
+                auto runEngine = [&](int count) {
+                    GeneticEngine engine;
+                    engine.input = input.clone();
+                    engine.target = target.clone();
+                    engine.population = population;
+                    engine.breedingPoolSize = population / 2;
+                    engine.generations = count;
+                    engine.threads = threads;
+                    engine.seed = 1;
+
+                    QElapsedTimer timer;
+                    timer.start();
+                    const int status = engine.run();
+                    return status ? -1 : timer.nsecsElapsed();
+                };
+
+                fprintf(stderr, "engine.generation population %d threads %d\n", population, threads);
+
+                // Setup, the first generation and the final report cost the
+                // same in both runs and cancel out
+                const qint64 shortRun = runEngine(1);
+                const qint64 longRun = runEngine(1 + generations);
+
+                if (shortRun < 0 || longRun < 0) {
+                    fprintf(stderr, "The engine failed\n");
+                    return 1;
+                }
+
+                const double perGeneration = double(longRun - shortRun) / generations;
+                Benchmark::report("engine.generation", {
+                    { "population", double(population) },
+                    { "threads", double(threads) },
+                    { "size", double(size) },
+                    { "generations", double(generations) },
+                    { "mean_ns", perGeneration },
+                    { "setup_ns", double(shortRun) - perGeneration },
+                    { "items_per_second", perGeneration > 0 ? population * 1e9 / perGeneration : 0 }
+                });
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+#ifndef BOUNDEDSELECTION_H
+#define BOUNDEDSELECTION_H
+
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <vector>
+
+// Keeps the best 'capacity' items by (error, order) in a max-heap with the
+// worst entry on top, so each insertion is O(log capacity). Ties on error
+// go to the lower order, which makes the kept set independent of the order
+// items arrive in. Items are not owned: insert() hands back whichever item
+// fell out so the caller can delete it.
+template <typename T>
+class BoundedSelection
+{
+public:
+    explicit BoundedSelection(int capacity = 0) :
+        m_capacity(capacity),
+        m_bestError(std::numeric_limits<double>::infinity())
+    {
+    }
+
+    void setCapacity(int capacity) { m_capacity = capacity; }
+    int capacity() const { return m_capacity; }
+    int size() const { return int(heap.size()); }
+    bool isEmpty() const { return heap.empty(); }
+    bool isFull() const { return int(heap.size()) >= m_capacity; }
+
+    // Returns the item that dropped out (possibly 'item' itself), or null
+    T *insert(T *item, qreal error, quint64 order)
+    {
+        Entry entry;
+        entry.error = (error == error) ? error : std::numeric_limits<double>::infinity(); // NaN ranks last
+        entry.order = order;
+        entry.item = item;
+
+        if (m_capacity <= 0)
+            return item;
+
+        if (!isFull()) {
+            heap.push_back(entry);
+            std::push_heap(heap.begin(), heap.end(), ranksBefore);
+            m_bestError = qMin(m_bestError, entry.error);
+            return 0;
+        }
+
+        if (!ranksBefore(entry, heap.front()))
+            return item;
+
+        std::pop_heap(heap.begin(), heap.end(), ranksBefore);
+        T *dropped = heap.back().item;
+        heap.back() = entry;
+        std::push_heap(heap.begin(), heap.end(), ranksBefore);
+        m_bestError = qMin(m_bestError, entry.error);
+
+        return dropped;
+    }
+
+    // Error a newcomer has to beat, infinite until the selection is full
+    qreal worstError() const
+    {
+        return isFull() && !heap.empty() ? heap.front().error : std::numeric_limits<double>::infinity();
+    }
+
+    qreal bestError() const { return m_bestError; }
+
+    // Best first
+    QList<T*> sorted() const
+    {
+        std::vector<Entry> entries = heap;
+        std::sort(entries.begin(), entries.end(), ranksBefore);
+
+        QList<T*> items;
+        items.reserve(int(entries.size()));
+        for (const Entry &entry : entries)
+            items.append(entry.item);
+
+        return items;
+    }
+
+    QList<T*> takeAll()
+    {
+        QList<T*> items = sorted();
+        clear();
+        return items;
+    }
+
+    void clear()
+    {
+        heap.clear();
+        m_bestError = std::numeric_limits<double>::infinity();
+    }
+
+private:
+    struct Entry {
+        qreal error;
+        quint64 order;
+        T *item;
+    };
+
+    static bool ranksBefore(const Entry &a, const Entry &b)
+    {
+        return a.error < b.error || (a.error == b.error && a.order < b.order);
+    }
+
+    int m_capacity;
+    qreal m_bestError;
+    std::vector<Entry> heap;
+};
+
+// Thread-safe variant for insertion straight from the workers. Candidates
+// that cannot beat the published threshold are turned away without taking
+// the lock, which is the common case once the pool has filled up.
+template <typename T>
+class ConcurrentBoundedSelection
+{
+public:
+    explicit ConcurrentBoundedSelection(int capacity = 0) :
+        selection(capacity),
+        threshold(std::numeric_limits<double>::infinity())
+    {
+    }
+
+    void setCapacity(int capacity)
+    {
+        QMutexLocker locker(&mutex);
+        selection.setCapacity(capacity);
+        threshold.store(selection.worstError());
+    }
+
+    T *insert(T *item, qreal error, quint64 order)
+    {
+        if (error > threshold.load(std::memory_order_relaxed))
+            return item;
+
+        QMutexLocker locker(&mutex);
+        T *dropped = selection.insert(item, error, order);
+        threshold.store(selection.worstError());
+
+        return dropped;
+    }
+
+    qreal worstError() const { return threshold.load(); }
+
+    qreal bestError()
+    {
+        QMutexLocker locker(&mutex);
+        return selection.bestError();
+    }
+
+    int size()
+    {
+        QMutexLocker locker(&mutex);
+        return selection.size();
+    }
+
+    QList<T*> sorted()
+    {
+        QMutexLocker locker(&mutex);
+        return selection.sorted();
+    }
+
+    QList<T*> takeAll()
+    {
+        QMutexLocker locker(&mutex);
+        QList<T*> items = selection.takeAll();
+        threshold.store(selection.worstError());
+        return items;
+    }
+
+private:
+    BoundedSelection<T> selection;
+    QMutex mutex;
+    std::atomic<double> threshold;
+};
+
+#endif // BOUNDEDSELECTION_H
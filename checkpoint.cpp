@@ -0,0 +1,226 @@
+#include "checkpoint.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QtEndian>
+#include <cstring>
+
+namespace {
+
+const char magic[4] = { 'G', 'E', 'C', 'K' };
+
+template <typename T>
+void put(QByteArray &data, T value)
+{
+    uchar bytes[sizeof(T)];
+    qToLittleEndian<T>(value, bytes);
+    data.append(reinterpret_cast<const char*>(bytes), int(sizeof(T)));
+}
+
+void putDouble(QByteArray &data, double value)
+{
+    quint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put<quint64>(data, bits);
+}
+
+// Bounds-checked reads over the mapped file
+struct Reader {
+    const uchar *p;
+    const uchar *end;
+    bool ok;
+
+    template <typename T>
+    T get()
+    {
+        if (!ok || size_t(end - p) < sizeof(T)) {
+            ok = false;
+            return T(0);
+        }
+        T value = qFromLittleEndian<T>(p);
+        p += sizeof(T);
+        return value;
+    }
+
+    double getDouble()
+    {
+        quint64 bits = get<quint64>();
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+}
+
+QByteArray Checkpoint::encodeIsland(const Island &island)
+{
+    QByteArray data;
+
+    put<qint32>(data, island.index);
+    put<qint32>(data, island.generation);
+    put<quint64>(data, island.random.stateKey());
+    put<quint64>(data, island.random.stateCounter());
+    put<quint32>(data, quint32(island.individuals.size()));
+
+    for (const auto& individual : island.individuals) {
+        putDouble(data, individual.error);
+        put<quint32>(data, quint32(individual.program.size()));
+        data.append(individual.program);
+    }
+
+    return data;
+}
+
+QByteArray Checkpoint::encode(quint64 seed, const QList<QByteArray> &islandSections)
+{
+    QByteArray data;
+
+    data.append(magic, 4);
+    put<quint32>(data, version);
+    put<quint64>(data, seed);
+    put<quint32>(data, quint32(islandSections.size()));
+
+    for (const auto& section : islandSections)
+        data.append(section);
+
+    return data;
+}
+
+bool Checkpoint::load(const QString &path, quint64 *seed, QList<Island> *islands)
+{
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly) || file.size() < 20)
+        return false;
+
+    const uchar *mapped = file.map(0, file.size());
+    if (!mapped)
+        return false;
+
+    Reader reader = { mapped, mapped + file.size(), true };
+    QList<Island> loaded;
+
+    if (memcmp(mapped, magic, 4) != 0) {
+        file.unmap(const_cast<uchar*>(mapped));
+        return false;
+    }
+    reader.p += 4;
+
+    const quint32 fileVersion = reader.get<quint32>();
+    const quint64 fileSeed = reader.get<quint64>();
+    const quint32 islandCount = reader.get<quint32>();
+
+    if (fileVersion != version)
+        reader.ok = false;
+
+    for (quint32 i = 0; i < islandCount && reader.ok; ++i) {
+        Island island;
+        island.index = reader.get<qint32>();
+        island.generation = reader.get<qint32>();
+        const quint64 key = reader.get<quint64>();
+        const quint64 counter = reader.get<quint64>();
+        island.random = GeneticRandom::fromState(key, counter);
+        const quint32 individuals = reader.get<quint32>();
+
+        for (quint32 j = 0; j < individuals && reader.ok; ++j) {
+            Individual individual;
+            individual.error = reader.getDouble();
+            const quint32 size = reader.get<quint32>();
+
+            if (!reader.ok || quint64(reader.end - reader.p) < size) {
+                reader.ok = false;
+                break;
+            }
+
+            individual.program = QByteArray(reinterpret_cast<const char*>(reader.p), int(size));
+            reader.p += size;
+            island.individuals.append(individual);
+        }
+
+        loaded.append(island);
+    }
+
+    const bool ok = reader.ok && reader.p == reader.end;
+    file.unmap(const_cast<uchar*>(mapped));
+
+    if (!ok)
+        return false;
+
+    *seed = fileSeed;
+    *islands = loaded;
+    return true;
+}
+
+Checkpoint::Writer::Writer() :
+    written(0),
+    failed(0),
+    pending(false),
+    busy(false),
+    stopping(false)
+{
+    start(QThread::LowPriority);
+}
+
+Checkpoint::Writer::~Writer()
+{
+    {
+        QMutexLocker locker(&mutex);
+        stopping = true;
+        changed.wakeAll();
+    }
+
+    wait();
+}
+
+void Checkpoint::Writer::write(const QString &path, const QByteArray &data)
+{
+    QMutexLocker locker(&mutex);
+
+    pendingPath = path;
+    pendingData = data;
+    pending = true;
+    changed.wakeAll();
+}
+
+void Checkpoint::Writer::flush()
+{
+    QMutexLocker locker(&mutex);
+
+    while (pending || busy)
+        changed.wait(&mutex);
+}
+
+void Checkpoint::Writer::run()
+{
+    QMutexLocker locker(&mutex);
+
+    for (;;) {
+        while (!pending && !stopping)
+            changed.wait(&mutex);
+
+        if (!pending)
+            return; // Stopping with nothing left to write
+
+        const QString path = pendingPath;
+        const QByteArray data = pendingData;
+        pending = false;
+        busy = true;
+        locker.unlock();
+
+        QSaveFile file(path);
+        bool ok = file.open(QIODevice::WriteOnly)
+                && file.write(data) == data.size()
+                && file.commit();
+
+        if (!ok)
+            qWarning() << "Cannot write checkpoint" << path;
+
+        locker.relock();
+        busy = false;
+        ok ? ++written : ++failed;
+        changed.wakeAll();
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "geneticrandom.h"
+
+// Versioned binary snapshot of a run, enough to resume it exactly: the
+// master seed and, per island, its generation, random stream and breeding
+// pool. Programs are stored as GeneticProgram::toByteArray() and outputs
+// are left out, they are rendered again when needed. All integers are
+// little endian.
+//
+//   "GECK" quint32 version quint64 seed quint32 islands
+//   per island:     qint32 index qint32 generation quint64 key quint64 counter quint32 individuals
+//   per individual: float64 error quint32 size, size bytes of program
+class Checkpoint
+{
+public:
+    struct Individual {
+        double error;
+        QByteArray program;
+    };
+
+    struct Island {
+        int index;
+        int generation;
+        GeneticRandom random;
+        QList<Individual> individuals; // Best first
+    };
+
+    static const quint32 version = 1;
+
+    static QByteArray encodeIsland(const Island &island); // One island's section
+    static QByteArray encode(quint64 seed, const QList<QByteArray> &islandSections);
+
+    // Maps the file instead of reading it. Programs are copied out, so
+    // nothing refers to the mapping afterwards. False for a missing,
+    // truncated or foreign file, or another version.
+    static bool load(const QString &path, quint64 *seed, QList<Island> *islands);
+
+    // Writes checkpoints on a thread of its own, through QSaveFile so a
+    // crash mid-write leaves the previous checkpoint intact. Writes never
+    // block the caller, and a checkpoint still pending when a newer one
+    // arrives is skipped.
+    class Writer : public QThread
+    {
+    public:
+        Writer();
+        ~Writer(); // Finishes the pending write
+
+        void write(const QString &path, const QByteArray &data);
+        void flush(); // Returns once nothing is pending
+
+        int written;
+        int failed;
+
+    protected:
+        void run();
+
+    private:
+        QMutex mutex;
+        QWaitCondition changed;
+        QString pendingPath;
+        QByteArray pendingData;
+        bool pending;
+        bool busy;
+        bool stopping;
+    };
+};
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,348 @@
+#include "deploypipeline.h"
+#include "checkpoint.h"
+#include "tileevaluator.h"
+#include "workstealingpool.h"
+#include <opencv2/opencv.hpp>
+
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QThread>
+#include <QWaitCondition>
+#include <deque>
+#include <functional>
+
+using namespace cv;
+
+namespace {
+
+class StageThread : public QThread
+{
+public:
+    StageThread(const std::function<void()> &body) : body(body) {}
+
+protected:
+    void run() { body(); }
+
+private:
+    std::function<void()> body;
+};
+
+// Blocks the producer while full and the consumer while empty. Closing
+// wakes both: the consumer still drains what is queued, the producer's
+// pushes fail, so either end can stop the other.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(int capacity) : capacity(qMax(1, capacity)), closed(false) {}
+
+    bool push(const T &item)
+    {
+        QMutexLocker locker(&mutex);
+        while (int(items.size()) >= capacity && !closed)
+            notFull.wait(&mutex);
+
+        if (closed)
+            return false;
+
+        items.push_back(item);
+        notEmpty.wakeOne();
+        return true;
+    }
+
+    bool pop(T *item)
+    {
+        QMutexLocker locker(&mutex);
+        while (items.empty() && !closed)
+            notEmpty.wait(&mutex);
+
+        if (items.empty())
+            return false;
+
+        *item = items.front();
+        items.pop_front();
+        notFull.wakeOne();
+        return true;
+    }
+
+    void close()
+    {
+        QMutexLocker locker(&mutex);
+        closed = true;
+        notFull.wakeAll();
+        notEmpty.wakeAll();
+    }
+
+private:
+    const int capacity;
+    QMutex mutex;
+    QWaitCondition notFull;
+    QWaitCondition notEmpty;
+    std::deque<T> items;
+    bool closed;
+};
+
+bool isVideoFile(const QString &path)
+{
+    static const QStringList suffixes = { "avi", "mp4", "mkv", "mov" };
+    return suffixes.contains(QFileInfo(path).suffix().toLower());
+}
+
+}
+
+struct DeployPipeline::Frame {
+    int index;
+    QString name; // Output file name when writing a directory
+    Mat planes[3]; // CV_32F, the input until evaluated, then the output
+    qint64 started; // When decoding began, on the pipeline's clock
+};
+
+DeployPipeline::Latency::Latency() :
+    frames(0),
+    total(0),
+    maximum(0)
+{
+}
+
+void DeployPipeline::Latency::add(qint64 nanoseconds)
+{
+    ++frames;
+    total += nanoseconds;
+    maximum = qMax(maximum, nanoseconds);
+}
+
+double DeployPipeline::Latency::meanMilliseconds() const
+{
+    return frames ? double(total) / frames / 1e6 : 0;
+}
+
+double DeployPipeline::Latency::maximumMilliseconds() const
+{
+    return double(maximum) / 1e6;
+}
+
+DeployPipeline::DeployPipeline() :
+    threads(0),
+    queueSize(4),
+    bandRows(16),
+    evaluationMode(GeneticProgram::JitEvaluation),
+    pool(0)
+{
+}
+
+DeployPipeline::~DeployPipeline()
+{
+    delete pool;
+}
+
+bool DeployPipeline::loadProgram(const QString &path, QString *error)
+{
+    if (program.load(path))
+        return true;
+
+    quint64 seed;
+    QList<Checkpoint::Island> islands;
+
+    if (Checkpoint::load(path, &seed, &islands)) {
+        const Checkpoint::Individual *best = 0;
+        for (const auto& island : islands) {
+            if (!island.individuals.isEmpty() && (!best || island.individuals.first().error < best->error))
+                best = &island.individuals.first();
+        }
+
+        if (best && program.fromByteArray(best->program))
+            return true;
+    }
+
+    *error = "Cannot read a program from " + path;
+    return false;
+}
+
+int DeployPipeline::run()
+{
+    QStringList images;
+    VideoCapture capture;
+    double framesPerSecond = 25; // Written video keeps the input's rate, image directories get this one
+
+    if (QFileInfo(inputPath).isDir()) {
+        images = QDir(inputPath).entryList({ "*.png", "*.jpg", "*.jpeg", "*.bmp", "*.tif", "*.tiff", "*.ppm" },
+                                           QDir::Files, QDir::Name);
+        if (images.isEmpty()) {
+            qCritical() << "No images in" << inputPath;
+            return 1;
+        }
+    } else {
+        if (!capture.open(inputPath.toStdString())) {
+            qCritical() << "Cannot open" << inputPath;
+            return 1;
+        }
+        if (capture.get(CV_CAP_PROP_FPS) > 0)
+            framesPerSecond = capture.get(CV_CAP_PROP_FPS);
+    }
+
+    const bool videoOutput = isVideoFile(outputPath);
+    if (!videoOutput && !QDir().mkpath(outputPath)) {
+        qCritical() << "Cannot create" << outputPath;
+        return 1;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        code[i] = GeneticTree::simplify(program.m_genome[i]->code);
+        compiled[i].clear();
+        if (evaluationMode == GeneticProgram::JitEvaluation && GeneticJit::isSupported())
+            compiled[i] = GeneticJit::instance().compile(code[i]);
+    }
+
+    if (!pool)
+        pool = new WorkStealingPool(threads);
+
+    decodeLatency = Latency();
+    evaluateLatency = Latency();
+    encodeLatency = Latency();
+    frameLatency = Latency();
+
+    BoundedQueue<Frame> decoded(queueSize);
+    BoundedQueue<Frame> evaluated(queueSize);
+    bool decodeFailed = false;
+    bool encodeFailed = false;
+
+    QElapsedTimer clock;
+    clock.start();
+
+    StageThread decoder([&]() {
+        for (int index = 0; ; ++index) {
+            Frame frame;
+            frame.index = index;
+            frame.started = clock.nsecsElapsed();
+
+            Mat image;
+            if (images.isEmpty()) {
+                if (!capture.read(image))
+                    break;
+                frame.name = QString("%1.png").arg(index, 6, 10, QChar('0'));
+            } else {
+                if (index == images.size())
+                    break;
+                frame.name = images.at(index);
+                image = imread(QDir(inputPath).filePath(frame.name).toStdString(), CV_LOAD_IMAGE_COLOR);
+                if (image.empty()) {
+                    qCritical() << "Cannot read" << frame.name;
+                    decodeFailed = true;
+                    break;
+                }
+            }
+
+            image.convertTo(image, CV_32F);
+            split(image, frame.planes);
+            decodeLatency.add(clock.nsecsElapsed() - frame.started);
+
+            if (!decoded.push(frame))
+                break;
+        }
+        decoded.close();
+    });
+
+    StageThread encoder([&]() {
+        VideoWriter writer;
+        Frame frame;
+
+        while (evaluated.pop(&frame)) {
+            const qint64 start = clock.nsecsElapsed();
+
+            Mat image;
+            merge(frame.planes, 3, image);
+            image.convertTo(image, CV_8U);
+
+            if (videoOutput) {
+                if (!writer.isOpened() && !writer.open(outputPath.toStdString(), CV_FOURCC('M', 'J', 'P', 'G'),
+                                                       framesPerSecond, Size(image.cols, image.rows))) {
+                    qCritical() << "Cannot write" << outputPath;
+                    encodeFailed = true;
+                    break;
+                }
+                writer.write(image);
+            } else if (!imwrite(QDir(outputPath).filePath(frame.name).toStdString(), image)) {
+                qCritical() << "Cannot write" << frame.name;
+                encodeFailed = true;
+                break;
+            }
+
+            const qint64 end = clock.nsecsElapsed();
+            encodeLatency.add(end - start);
+            frameLatency.add(end - frame.started);
+        }
+        evaluated.close(); // Stops the stages before this one on failure
+    });
+
+    decoder.start();
+    encoder.start();
+
+    Frame frame;
+    while (decoded.pop(&frame)) {
+        const qint64 start = clock.nsecsElapsed();
+        evaluate(frame);
+        evaluateLatency.add(clock.nsecsElapsed() - start);
+
+        if (!evaluated.push(frame))
+            break;
+    }
+    decoded.close();
+    evaluated.close();
+
+    // Frames already queued for the encoder are still written
+    decoder.wait();
+    encoder.wait();
+
+    const double seconds = clock.nsecsElapsed() / 1e9;
+
+    qDebug() << "Frames:" << frameLatency.frames << "in" << seconds << "s,"
+             << (seconds > 0 ? frameLatency.frames / seconds : 0) << "frames/s";
+    qDebug() << "Decode:" << decodeLatency.meanMilliseconds() << "ms mean" << decodeLatency.maximumMilliseconds() << "ms max";
+    qDebug() << "Evaluate:" << evaluateLatency.meanMilliseconds() << "ms mean" << evaluateLatency.maximumMilliseconds() << "ms max"
+             << "on" << pool->workerCount() << "workers";
+    qDebug() << "Encode:" << encodeLatency.meanMilliseconds() << "ms mean" << encodeLatency.maximumMilliseconds() << "ms max";
+    qDebug() << "Frame:" << frameLatency.meanMilliseconds() << "ms mean" << frameLatency.maximumMilliseconds() << "ms max";
+
+    return (decodeFailed || encodeFailed) ? 1 : 0;
+}
+
+void DeployPipeline::evaluate(Frame &frame)
+{
+    const int rows = frame.planes[0].rows;
+    const int cols = frame.planes[0].cols;
+    const int rowsPerBand = qMax(1, bandRows);
+    const int bands = (rows + rowsPerBand - 1) / rowsPerBand;
+
+    Mat output[3];
+    for (int i = 0; i < 3; ++i) {
+        Q_ASSERT(frame.planes[i].isContinuous());
+        output[i].create(rows, cols, CV_32F);
+    }
+
+    pool->parallelFor(3 * bands, [&](int task) {
+        const int channel = task % 3;
+        const int first = (task / 3) * rowsPerBand;
+        const int last = qMin(rows, first + rowsPerBand);
+        evaluateBand(channel, frame.planes[channel].ptr<float>(first), output[channel].ptr<float>(first), (last - first) * cols);
+    });
+
+    for (int i = 0; i < 3; ++i)
+        frame.planes[i] = output[i];
+}
+
+void DeployPipeline::evaluateBand(int channel, const float *input, float *output, int count) const
+{
+    // As GeneticJit::evaluate, without its cache lookup for every band
+    const int vectorCount = compiled[channel] ? (count & ~3) : 0;
+
+    if (vectorCount)
+        compiled[channel]->function(input, output, vectorCount);
+
+    if (vectorCount < count)
+        TileEvaluator().evaluate(code[channel], input + vectorCount, output + vectorCount, count - vectorCount);
+}
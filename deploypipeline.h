@@ -0,0 +1,66 @@
+#ifndef DEPLOYPIPELINE_H
+#define DEPLOYPIPELINE_H
+
+#include <QSharedPointer>
+#include <QString>
+
+#include "geneticprogram.h"
+#include "geneticjit.h"
+
+class WorkStealingPool;
+
+// Applies one evolved program to a stream of frames: the images of a
+// directory in name order, or a video file. Decoding, evaluation and
+// encoding run as overlapped stages joined by bounded queues, so a stage
+// only stalls once the queue in front of it is full. Every pool worker
+// evaluates the same frame, a band of rows and one channel at a time.
+class DeployPipeline
+{
+public:
+    DeployPipeline();
+    ~DeployPipeline();
+
+    // A file saved by GeneticProgram::save(), or a checkpoint whose best
+    // individual is taken
+    bool loadProgram(const QString &path, QString *error);
+
+    int run(); // Exit status, 0 on success
+
+    QString inputPath; // Directory of images or a video file
+    QString outputPath; // Directory, frames keep their names, or a video file
+    int threads; // Pool workers, 0 uses every core
+    int queueSize; // Frames waiting between two stages
+    int bandRows; // Rows evaluated per task
+    GeneticProgram::EvaluationMode evaluationMode; // Reference is evaluated tiled, bands need no whole planes
+
+    // Time spent by a stage on each frame, queue waits excluded
+    struct Latency {
+        Latency();
+        void add(qint64 nanoseconds);
+        double meanMilliseconds() const;
+        double maximumMilliseconds() const;
+        qint64 frames;
+        qint64 total;
+        qint64 maximum;
+    };
+
+    Latency decodeLatency;
+    Latency evaluateLatency;
+    Latency encodeLatency;
+    Latency frameLatency; // From the start of decoding to the end of encoding
+
+private:
+    Q_DISABLE_COPY(DeployPipeline)
+
+    struct Frame;
+
+    void evaluate(Frame &frame);
+    void evaluateBand(int channel, const float *input, float *output, int count) const;
+
+    GeneticProgram program;
+    GeneticTree::Code code[3]; // Simplified once for every frame
+    QSharedPointer<GeneticJit::CompiledTree> compiled[3]; // Null where tiles evaluate
+    WorkStealingPool *pool;
+};
+
+#endif // DEPLOYPIPELINE_H
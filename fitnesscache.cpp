@@ -0,0 +1,66 @@
+#include "fitnesscache.h"
+
+#include <QMutexLocker>
+
+FitnessCache::FitnessCache(int capacity, GeneticMetrics::Counter hitCounter) :
+    hits(0),
+    misses(0),
+    hitCounter(hitCounter),
+    cache(capacity)
+{
+}
+
+bool FitnessCache::lookup(quint64 hash, int level, qreal abortAbove, qreal *error)
+{
+    QMutexLocker locker(&mutex);
+
+    const Score *score = cache.object(Key(hash, level)); // Also marks it as recently used
+
+    if (score && (score->exact || score->error > abortAbove)) {
+        ++hits;
+        GeneticMetrics::add(hitCounter);
+        *error = score->error;
+        return true;
+    }
+
+    ++misses;
+    GeneticMetrics::add(GeneticMetrics::Counter(hitCounter + 1));
+    return false;
+}
+
+void FitnessCache::insert(quint64 hash, int level, qreal error, bool exact)
+{
+    QMutexLocker locker(&mutex);
+
+    Key key(hash, level);
+    const Score *previous = cache.object(key);
+
+    // Never trade an exact score for a bound
+    if (previous && previous->exact && !exact)
+        return;
+
+    Score *score = new Score;
+    score->error = error;
+    score->exact = exact;
+    cache.insert(key, score, 1);
+}
+
+void FitnessCache::setCapacity(int capacity)
+{
+    QMutexLocker locker(&mutex);
+    cache.setMaxCost(capacity);
+}
+
+int FitnessCache::capacity() const
+{
+    QMutexLocker locker(&mutex);
+    return cache.maxCost();
+}
+
+void FitnessCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    cache.clear();
+    hits = 0;
+    misses = 0;
+}
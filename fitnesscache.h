@@ -0,0 +1,49 @@
+#ifndef FITNESSCACHE_H
+#define FITNESSCACHE_H
+
+#include <QCache>
+#include <QMutex>
+#include <QPair>
+
+#include "geneticmetrics.h"
+
+// Scores already measured, keyed by GeneticProgram::structuralHash() and
+// pyramid level. Breeding produces many exact copies of earlier programs
+// (shallow parents, self-crossover, no mutation), and those cost a lookup
+// instead of an evaluation. Least recently used entries are evicted once
+// the cache holds capacity scores.
+class FitnessCache
+{
+public:
+    // Lookups are counted as hitCounter, misses as the counter after it
+    explicit FitnessCache(int capacity = 65536, GeneticMetrics::Counter hitCounter = GeneticMetrics::FitnessCacheHits);
+
+    // True if the cached score settles it: either the exact error, or an
+    // aborted score that was already above abortAbove
+    bool lookup(quint64 hash, int level, qreal abortAbove, qreal *error);
+    // exact is false when scoring gave up early and error is only a lower bound
+    void insert(quint64 hash, int level, qreal error, bool exact);
+
+    void setCapacity(int capacity);
+    int capacity() const;
+    void clear(); // Scores are only valid for the images they were measured on
+
+    quint64 hits;
+    quint64 misses;
+
+private:
+    Q_DISABLE_COPY(FitnessCache)
+
+    struct Score {
+        qreal error;
+        bool exact;
+    };
+
+    typedef QPair<quint64, int> Key;
+
+    const GeneticMetrics::Counter hitCounter;
+    mutable QMutex mutex;
+    QCache<Key, Score> cache;
+};
+
+#endif // FITNESSCACHE_H
@@ -1,118 +1,165 @@
 #include "geneticengine.h"
+#include "geneticisland.h"
+#include "migrationchannel.h"
+#include "resultslog.h"
 #include "genetictree.h"
+#include "genetickernels.h"
+#include "geneticjit.h"
 #include <opencv2/opencv.hpp>
 
+#include <QCoreApplication>
 #include <QDebug>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QMutexLocker>
 #include <QThread>
+#include <functional>
 
 using namespace cv;
 
-GeneticEngine::GeneticEngine(int argc, char *argv[]) :
-    QApplication(argc, argv),
+namespace {
+
+class IslandThread : public QThread
+{
+public:
+    IslandThread(const std::function<void()> &body) : body(body) {}
+
+protected:
+    void run() { body(); }
+
+private:
+    std::function<void()> body;
+};
+
+}
+
+GeneticEngine::GeneticEngine(QObject *parent) :
+    QObject(parent),
+    windowSize(8),
+    batchSize(0),
+    patchSize(0),
+    rescoreInterval(5),
+    loaderThreads(2),
+    checkpointInterval(10),
+    metricsFormat(GeneticMetrics::JsonLines),
+    interactive(false),
     population(200),
     breedingPoolSize(100),
     generations(50),
-    initialDepth(20)
+    initialDepth(20),
+    downscale(1),
+    pyramidLevels(3),
+    promotionRatio(0.5),
+    fitnessCacheSize(65536),
+    subtreeCacheBudget(qint64(256) << 20),
+    evaluationMode(GeneticProgram::JitEvaluation),
+    threads(0),
+    seed(quint64(QDateTime::currentMSecsSinceEpoch())),
+    islandCount(1),
+    migrationInterval(5),
+    migrantCount(3),
+    processIndex(0),
+    processCount(1),
+    channelCache(65536, GeneticMetrics::ChannelCacheHits),
+    pool(0),
+    metricsExporter(0),
+    checkpointWriter(0)
 {
-    Q_UNUSED(argc);
-    Q_UNUSED(argv);
 }
 
-bool lowestError(GeneticEngine::GeneticData* a, GeneticEngine::GeneticData* b)
+GeneticEngine::~GeneticEngine()
 {
-    return a->error < b->error;
+    qDeleteAll(islands); // bestList went with its island
+    qDeleteAll(channels);
+    delete checkpointWriter; // Finishes the last write
+    delete metricsExporter;
+    delete pool;
 }
 
-void GeneticEngine::firstGeneration()
+void GeneticEngine::runIsland(GeneticIsland *island, ResultsLog *logger)
 {
-
-    qsrand(QDateTime::currentDateTime().toMSecsSinceEpoch());
-
-    for (int i = 0; i < population; ++i) {
-
-        processEvents();
-
-        GeneticProgram *program = new GeneticProgram;
-        program->setMatrix(input);
-        program->setMaxInitialDepth(initialDepth);
-        program->generateGenome();
-
-        Mat output = program->evaluate().clone();
-        Mat diff;
-
-        absdiff(target, output, diff);
-
-        Scalar bgr = mean(diff);
-        qreal error = qMax(qMax(bgr[0], bgr[1]), bgr[2]);
-
-        GeneticData *data = new GeneticData;
-        data->error = error;
-        data->output = output.clone();
-        *(data->program) = *program;
-
-        bestList.append(data);
-
-        qDebug() << QString::number((double(i) / double(population)) * 100.00)
-                 << "%" << bestList.at(0)->error
-                 << program->m_genome.at(0)->depthOfTree();
-
-
-        if (bestList.size() > breedingPoolSize) {
-            std::sort(bestList.begin(), bestList.end(), lowestError);
-            delete bestList.last();
-            bestList.removeLast();
+    const bool mainThread = (QThread::currentThread() == thread());
+    QElapsedTimer timer;
+
+    // Elites get their full set error every rescoreInterval generations and
+    // at the end, the time spent on it counts towards the generation
+    auto finishGeneration = [&]() {
+        const int generation = island->currentGeneration + 1;
+
+        if (rescoresAfter(generation))
+            island->rescoreElites();
+
+        logger->writeGeneration(island->index, generation, timer.elapsed(), island->bestList);
+        checkpoint(island);
+
+        if (metricsExporter && !metricsExporter->write(generation, island->index))
+            qWarning() << "Cannot write" << metricsPath;
+    };
+
+    // A restored island already has its breeding pool
+    if (island->bestList.isEmpty()) {
+        timer.start();
+        island->firstGeneration();
+        if (!trainingSet.error().isEmpty())
+            return;
+
+        // Joins the checkpoint straight away, so the islands that are due
+        // first do not wait for it
+        if (checkpointWriter) {
+            const QByteArray section = Checkpoint::encodeIsland(island->snapshot());
+            QMutexLocker locker(&checkpointMutex);
+            checkpointSections[island->index] = section;
         }
 
-        delete program;
+        finishGeneration();
+    }
+    while (island->currentGeneration + 1 < generations) {
+        if (mainThread && interactive) {
+            bestList = island->bestList;
+            analyse();
+        }
+        timer.start();
+        island->nextGeneration();
+        if (!trainingSet.error().isEmpty())
+            return; // A window without a readable pair, run() reports it
+        finishGeneration();
     }
 }
 
-void GeneticEngine::nextGeneration()
+bool GeneticEngine::rescoresAfter(int generation) const
 {
-    qDeleteAll(newBestList);
-    newBestList.clear();
-    newBestList = bestList; // Shallow copy data to new list
-    bestList.clear(); // Reset for next generation
-
-
-    for (int i = 0; i < population; ++i) {
-
-        processEvents();
-
-        int thisElement = i % breedingPoolSize;
-        int randomElement = (qrand()) % breedingPoolSize;
+    return trainingSet.isSampled() && rescoreInterval > 0
+            && (generation % rescoreInterval == 0 || generation == generations);
+}
 
-        while (randomElement == thisElement)
-            randomElement = (qrand()) % breedingPoolSize;
+void GeneticEngine::checkpoint(GeneticIsland *island)
+{
+    const int generation = island->currentGeneration + 1;
 
-        const auto program1 = newBestList[thisElement]->program;
-        const auto program2 = newBestList[randomElement]->program;
+    if (!checkpointWriter || checkpointInterval <= 0
+            || (generation % checkpointInterval != 0 && generation < generations))
+        return;
 
-        Q_ASSERT(program1 && program2);
+    // Only genomes are copied here, encoding and writing happen elsewhere
+    const QByteArray section = Checkpoint::encodeIsland(island->snapshot());
 
-        GeneticData *data = new GeneticData;
-        data->program = program1->breedWithProgram(program2);
-        Mat output = data->program->evaluate();
-        Mat diff;
-        absdiff(target, output, diff);
-        Scalar bgr = mean(diff);
-        qreal error = qMax(qMax(bgr[0], bgr[1]), bgr[2]);
-        data->error = error;
-        data->output = output;
+    QMutexLocker locker(&checkpointMutex);
+    checkpointSections[island->index] = section;
 
-        bestList.append(data);
+    // A file without every island could not be resumed from, and would
+    // replace one that could
+    if (checkpointSections.size() < islands.size())
+        return;
 
-        if (bestList.size() > breedingPoolSize) {
-            std::sort(bestList.begin(), bestList.end(), lowestError);
-            delete bestList.last();
-            bestList.removeLast();
-        }
+    checkpointWriter->write(checkpointFile(), Checkpoint::encode(seed, checkpointSections.values()));
+}
 
-        qDebug() << QString::number((double(i) / double(population)) * 100.00)
-                 << "%" << bestList.at(0)->error
-                 << bestList.at(0)->program->m_genome.at(0)->depthOfTree();
-    }
+QString GeneticEngine::checkpointFile() const
+{
+    // Processes of one run keep their islands apart
+    if (processCount > 1 && !migrationSocketPath.isEmpty())
+        return checkpointPath + "." + QString::number(processIndex);
+    return checkpointPath;
 }
 
 void GeneticEngine::medianError()
@@ -137,6 +184,9 @@ void GeneticEngine::medianError()
 
 void GeneticEngine::analyse()
 {
+    if (bestList.at(0)->output.empty())
+        bestList.at(0)->output = bestList.at(0)->program->evaluate();
+
     Mat best = bestList.at(0)->output;
     best.convertTo(best, CV_8U);
     imshow("best", best);
@@ -174,71 +224,327 @@ void GeneticEngine::analyse()
     merge(bgr, 3, test);
 
     imshow("RGB responses", test);
-    bestProgram->setMatrix(input);
+    bestProgram->setPlanes(inputPlanes);
 }
 
-void GeneticEngine::start()
+void GeneticEngine::reportPrecisionBounds()
 {
-    Mat preInput = imread("/home/sam/Pictures/test2.png",CV_LOAD_IMAGE_COLOR);
-    Mat preTarget = imread("/home/sam/Pictures/test3.png", CV_LOAD_IMAGE_COLOR);
+    TrainingSet::WindowPointer window = trainingSet.fullWindow(0);
+
+    for (int level = 0; level < int(window->levels.size()); ++level) {
+        const TrainingSet::Level &planes = window->levels[level];
+
+        if (planes.precision == GeneticKernels::Float32)
+            continue;
+
+        // Programs like the first generation's, on a stream of their own so
+        // the islands draw the same whatever the precision
+        GeneticRandom random(~seed);
+        const int programs = 32;
+        int compared = 0;
+        qreal largest = 0;
+        qreal total = 0;
+
+        for (int i = 0; i < programs; ++i) {
+            GeneticProgram program;
+            program.setPlanes(inputPlanes);
+            program.setMaxInitialDepth(initialDepth);
+            program.setEvaluationMode(GeneticProgram::TiledEvaluation);
+            program.generateGenome(random);
+
+            const qreal exact = program.score(planes.inputs, planes.targets);
+            const qreal reduced = program.score(planes.packedInputs, planes.packedTargets,
+                                                std::numeric_limits<qreal>::infinity(), 0, planes.precision);
+
+            // Programs that overflow float have no error to compare with
+            if (!qIsFinite(exact))
+                continue;
+
+            const qreal difference = qIsFinite(reduced) ? qAbs(reduced - exact) : std::numeric_limits<qreal>::infinity();
+            largest = qMax(largest, difference);
+            total += difference;
+            ++compared;
+        }
+
+        qDebug() << "Level" << level << GeneticKernels::precisionName(planes.precision)
+                 << "against float32, error difference max" << (largest / 255) * 100
+                 << "mean" << (compared ? (total / compared / 255) * 100 : 0) << "% over" << compared << "programs";
+    }
+}
+
+int GeneticEngine::run()
+{
+    QList<Checkpoint::Island> resumed;
+
+    if (!resumePath.isEmpty()) {
+        if (!Checkpoint::load(resumePath, &seed, &resumed)) {
+            qCritical() << "Cannot resume from" << resumePath;
+            return 1;
+        }
+        qDebug() << "Resuming from" << resumePath;
+    }
+
+    trainingSet.seed = seed; // Batches follow the master seed like everything else
+    trainingSet.windowSize = windowSize;
+    trainingSet.batchSize = batchSize;
+    trainingSet.patchSize = patchSize;
+    trainingSet.pyramidLevels = pyramidLevels;
+    trainingSet.downscale = downscale;
+    trainingSet.loaderThreads = loaderThreads;
+    trainingSet.precisions.assign(precisions.begin(), precisions.end());
+
+    QString shownInputPath = inputPath;
+    QString shownTargetPath = targetPath;
+
+    if (!manifestPath.isEmpty()) {
+        QString error;
+        if (!trainingSet.loadManifest(manifestPath, &error)) {
+            qCritical() << error;
+            return 1;
+        }
+
+        // Programs render, and the windows show, the first pair
+        shownInputPath = trainingSet.inputPath(0);
+        shownTargetPath = trainingSet.targetPath(0);
+    }
+
+    const bool inMemory = manifestPath.isEmpty() && inputPath.isEmpty() && targetPath.isEmpty();
+    Mat preInput = inMemory ? input : imread(shownInputPath.toStdString(), CV_LOAD_IMAGE_COLOR);
+    Mat preTarget = inMemory ? target : imread(shownTargetPath.toStdString(), CV_LOAD_IMAGE_COLOR);
 
-    int divider = 4;
+    if (preInput.empty() || preTarget.empty()) {
+        qCritical() << "Cannot read" << (preInput.empty() ? shownInputPath : shownTargetPath);
+        return 1;
+    }
 
-    resize(preInput, input, Size(preInput.cols / divider, preInput.rows / divider));
-    resize(preTarget, target, Size(preTarget.cols / divider, preTarget.rows / divider));
+    input = TrainingSet::downscaled(preInput, downscale);
+    target = TrainingSet::downscaled(preTarget, downscale);
 
-    imshow("input", input);
-    imshow("target", target);
+    if (interactive) {
+        imshow("input", input);
+        imshow("target", target);
+    }
     target.convertTo(target, CV_32F);
 
-    ResultsLog logger("/home/sam/results.txt");
+    if (!GeneticProgram::splitPlanes(input, inputPlanes)) {
+        qCritical() << "The input needs three channels";
+        return 1;
+    }
 
-    if (generations > 0) {
-        firstGeneration();
-        logger.writeCurrentData(1, bestList);
+    if (manifestPath.isEmpty() && !trainingSet.setPair(preInput, preTarget)) {
+        qCritical() << "The input and target need the same size and three channels";
+        return 1;
     }
-    for (int i = 0; i < (generations - 1); ++i) {
-        analyse();
-        nextGeneration();
-        logger.writeCurrentData(i + 2, bestList);
+
+    if (!trainingSet.window(0) || !trainingSet.fullWindow(0)) {
+        qCritical() << trainingSet.error();
+        return 1;
+    }
+
+    qDebug() << "Training pairs:" << trainingSet.pairCount() << "windows:" << trainingSet.windowCount()
+             << "sampled:" << trainingSet.isSampled()
+             << "fitness levels:" << int(trainingSet.window(0)->levels.size());
+
+    fitnessCache.clear();
+    fitnessCache.setCapacity(fitnessCacheSize);
+    channelCache.clear();
+    channelCache.setCapacity(fitnessCacheSize * 3);
+
+    reportPrecisionBounds();
+
+    qDebug() << "Kernels:" << GeneticKernels::isaName(GeneticKernels::table().isa);
+
+    qDebug() << "Seed:" << seed;
+
+    ResultsLog logger(resultsPath);
+
+    if (!resultsPath.isEmpty() && !logger.isOpen()) {
+        qCritical() << "Cannot write" << resultsPath;
+        return 1;
     }
 
+    delete metricsExporter;
+    metricsExporter = 0;
+
+    if (!metricsPath.isEmpty()) {
+        GeneticMetrics::enable();
+        metricsExporter = new GeneticMetrics::Exporter(metricsPath, metricsFormat);
+
+        if (!metricsExporter->isOpen()) {
+            qCritical() << "Cannot write" << metricsPath;
+            return 1;
+        }
+    }
+
+    if (!pool)
+        pool = new WorkStealingPool(threads);
+
+    // Islands are numbered across processes, this one owns a contiguous range
+    const int localIslands = qMax(1, islandCount);
+    const int processes = migrationSocketPath.isEmpty() ? 1 : qMax(1, processCount);
+    const int firstIsland = (processes > 1) ? processIndex * localIslands : 0;
+    const int totalIslands = processes * localIslands;
+
+    if (processCount > 1 && migrationSocketPath.isEmpty())
+        qWarning() << "Migration between processes needs a socket path, islands stay in this process";
+
+    qDeleteAll(islands);
+    islands.clear();
+    qDeleteAll(channels);
+    channels.clear();
+    bestList.clear();
+
+    // Every stream derives from the master seed, island 0 takes it unchanged
+    const GeneticRandom master(seed);
+    for (int i = 0; i < localIslands; ++i)
+        islands.append(new GeneticIsland(this, firstIsland + i, master.split(quint64(firstIsland + i))));
+
+    if (!resumePath.isEmpty()) {
+        for (const auto& island : islands) {
+            bool restored = false;
+
+            for (const auto& state : resumed) {
+                if (state.index == island->index)
+                    restored = island->restore(state);
+            }
+
+            if (!restored) {
+                qCritical() << "Checkpoint" << resumePath << "does not fit island" << island->index;
+                return 1;
+            }
+        }
+    }
+
+    checkpointSections.clear();
+    delete checkpointWriter;
+    checkpointWriter = checkpointPath.isEmpty() ? 0 : new Checkpoint::Writer;
+
+    // Restored islands are in the checkpoint from the start, so a rewrite
+    // of the file being resumed from never leaves one out
+    for (const auto& island : islands) {
+        if (checkpointWriter && !island->bestList.isEmpty())
+            checkpointSections[island->index] = Checkpoint::encodeIsland(island->snapshot());
+    }
+
+    if (totalIslands > 1) {
+        for (int i = 0; i < localIslands; ++i) {
+            GeneticIsland *island = islands.at(i);
+            const int next = (island->index + 1) % totalIslands;
+
+            if (migrationSocketPath.isEmpty()) {
+                MigrationChannel *queue = new QueueChannel;
+                channels.append(queue);
+                island->incoming = queue;
+            } else {
+                MigrationChannel *in = new SocketChannel(migrationSocketPath + "." + QString::number(island->index), true);
+                MigrationChannel *out = new SocketChannel(migrationSocketPath + "." + QString::number(next), false);
+                channels.append(in);
+                channels.append(out);
+                island->incoming = in;
+                island->outgoing = out;
+            }
+        }
+
+        if (migrationSocketPath.isEmpty()) {
+            for (int i = 0; i < localIslands; ++i)
+                islands.at(i)->outgoing = islands.at((i + 1) % localIslands)->incoming;
+        }
+
+        qDebug() << "Islands:" << firstIsland << "to" << firstIsland + localIslands - 1 << "of" << totalIslands;
+    }
+
+    if (islands.size() == 1) {
+        runIsland(islands.first(), &logger);
+    } else {
+        // Islands breed on their own threads and share the worker pool, this
+        // thread only keeps the windows responsive
+        QList<IslandThread*> islandThreads;
+        for (const auto& island : islands) {
+            IslandThread *thread = new IslandThread([this, island, &logger]() { runIsland(island, &logger); });
+            islandThreads.append(thread);
+            thread->start();
+        }
+
+        for (const auto& thread : islandThreads) {
+            while (!thread->wait(50)) {
+                if (interactive)
+                    QCoreApplication::processEvents();
+            }
+        }
+        qDeleteAll(islandThreads);
+    }
+
+    if (!trainingSet.error().isEmpty()) {
+        qCritical() << trainingSet.error();
+        return 1;
+    }
+
+    if (islands.size() > 1) {
+        for (const auto& island : islands) {
+            qDebug() << "Island" << island->index << "best error" << (island->bestList.at(0)->error / 255) * 100
+                     << "emigrants:" << island->emigrants << "immigrants:" << island->immigrants;
+        }
+    }
+
+    GeneticIsland *bestIsland = islands.first();
+    for (const auto& island : islands) {
+        if (island->bestList.at(0)->error < bestIsland->bestList.at(0)->error)
+            bestIsland = island;
+    }
+    bestList = bestIsland->bestList;
+
     qDebug() << endl << "Best error"
              << endl << (bestList.at(0)->error / 255) * 100;
 
     medianError();
 
-    Mat best = bestList.at(0)->output;
-    best.convertTo(best, CV_8U);
-    imshow("best", best);
-   // imwrite( "/home/sam/Pictures/bestTest.png", best);
-    processEvents();
+    qDebug() << "Fitness cache hits:" << fitnessCache.hits << "misses:" << fitnessCache.misses;
+    if (evaluationMode != GeneticProgram::ReferenceEvaluation)
+        qDebug() << "Channel cache hits:" << channelCache.hits << "misses:" << channelCache.misses;
 
-    // Testing reconstruction
+    if (evaluationMode == GeneticProgram::JitEvaluation) {
+        qDebug() << "JIT compilations:" << GeneticJit::instance().compilations
+                 << "cache hits:" << GeneticJit::instance().cacheHits;
+    }
 
-//    Mat newInput =  imread("/home/sam/Pictures/objects.png",CV_LOAD_IMAGE_COLOR);
-//    resize(newInput, newInput, Size(preTarget.cols / divider, preTarget.rows / divider));
+    if (!logger.close()) {
+        qCritical() << "Cannot write" << resultsPath;
+        return 1;
+    }
 
-//    imshow("input with objects", newInput);
+    if (checkpointWriter) {
+        checkpointWriter->flush();
+        if (checkpointWriter->failed > 0) {
+            qCritical() << "Checkpoints failed:" << checkpointWriter->failed;
+            return 1;
+        }
+    }
 
-    auto bestProgram = bestList.at(0)->program;
-    //bestProgram->setMatrix(newInput);
-//    Mat newBest = bestProgram->evaluate();
-//    newBest.convertTo(newBest, CV_8U);
+    if (bestList.at(0)->output.empty()) // Scoring never renders
+        bestList.at(0)->output = bestList.at(0)->program->evaluate();
 
-//    imshow("output with objects", newBest);
-    // imwrite( "/home/sam/Pictures/bestTestObjects.png", newBest);
+    Mat best = bestList.at(0)->output;
+    best.convertTo(best, CV_8U);
 
-    // Testing output responses
+    if (!outputPath.isEmpty() && !imwrite(outputPath.toStdString(), best)) {
+        qCritical() << "Cannot write" << outputPath;
+        return 1;
+    }
 
-   analyse();
+    if (!programPath.isEmpty() && !bestList.at(0)->program->save(programPath)) {
+        qCritical() << "Cannot write" << programPath;
+        return 1;
+    }
 
-//    imwrite("/home/sam/Desktop/test.png", test);
-//    imwrite("/home/sam/Desktop/redResponse.png", rOut);
-//    imwrite("/home/sam/Desktop/greenResponse.png", gOut);
-//    imwrite("/home/sam/Desktop/blueResponse.png", bOut);
+    if (interactive) {
+        imshow("best", best);
+        QCoreApplication::processEvents();
 
+        // Testing output responses
+        analyse();
+    }
 
+    return 0;
 }
 
 GeneticEngine::GeneticData::GeneticData() :
@@ -254,8 +560,8 @@ GeneticEngine::GeneticData &GeneticEngine::GeneticData::operator=(const GeneticE
 
     // Shallow copy source non-pointers
     error = source.error;
-    // Deep copys
-    output = source.output.clone();
+    // The output is rendered once and never written, so it is shared
+    output = source.output;
     *program = *(source.program);
     return *this;
 
@@ -265,33 +571,3 @@ GeneticEngine::GeneticData::~GeneticData()
 {
     delete program;
 }
-
-GeneticEngine::ResultsLog::ResultsLog(const QString &filePath) :
-    file(filePath)
-{
-    if (!file.open(QIODevice::WriteOnly))
-        Q_ASSERT(false);
-
-    out.setDevice(&file);   // we will serialize the data into the file
-}
-
-void GeneticEngine::ResultsLog::writeCurrentData(int generation, const QList<GeneticData*> &bestList)
-{
-    out << "Generation: " << generation << endl;
-    out << "Best error: " << (bestList.at(0)->error / 255) * 100 << endl;
-    out << "Median error: ";
-
-    if ((bestList.size() % 2) == 0) { // Even number
-        qreal median = (bestList.at(bestList.size() / 2)->error / 255) * 100;
-        out << QString::number(median);
-    } else if (bestList.size() == 1) {
-        out << QString::number((bestList.at(0)->error / 255) * 100);
-    } else { // Odd number
-        qreal median1 = (bestList.at((bestList.size() - 1) / 2)->error / 255) * 100;
-        qreal median2 = (bestList.at((bestList.size() + 1) / 2)->error / 255) * 100;
-        qreal median = (median1 + median2) / 2;
-        out << QString::number(median);
-    }
-
-    out << endl << endl;
-}
@@ -1,56 +1,123 @@
 #ifndef GENETICENGINE_H
 #define GENETICENGINE_H
 
-#include <QApplication>
-#include <QFile>
-#include <QTextStream>
+#include <QMap>
+#include <QMutex>
 
 #include "geneticprogram.h"
+#include "workstealingpool.h"
+#include "fitnesscache.h"
+#include "checkpoint.h"
+#include "trainingset.h"
+#include "geneticmetrics.h"
 
-class GeneticEngine : public QApplication
+class GeneticIsland;
+class MigrationChannel;
+class ResultsLog;
+
+// Runs a whole evolution. It needs no event loop: run() returns once the
+// last generation is scored. Windows are only shown when interactive is
+// set, which also requires a QApplication.
+class GeneticEngine : public QObject
 {
     Q_OBJECT
 
-    void firstGeneration();
-    void nextGeneration();
     void medianError();
     
 public:
-    GeneticEngine(int argc, char *argv[]);
+    explicit GeneticEngine(QObject *parent = 0);
+    ~GeneticEngine();
+
+    int run(); // Exit status, 0 on success
+
+    QString inputPath;
+    QString targetPath;
+    QString manifestPath; // Pairs to fit instead of inputPath and targetPath, see TrainingSet
+    int windowSize; // Manifest pairs scored per generation
+    int batchSize; // Pairs, or patches, drawn at random for each generation instead, 0 disables
+    int patchSize; // Side of batch patches in pixels, 0 batches whole pairs
+    int rescoreInterval; // Generations between full set scores of the breeding pool when batching
+    int loaderThreads; // Decoding manifest pairs ahead of the generation that needs them
+    QString resultsPath; // Per generation CSV, see ResultsLog, empty writes none
+    QString outputPath; // Best output image, empty writes none
+    QString programPath; // Best program for DeployPipeline, empty writes none
+    QString checkpointPath; // Rewritten every checkpointInterval generations and at the end, empty writes none
+    int checkpointInterval;
+    QString resumePath; // Checkpoint to carry on from, with its seed, empty starts afresh
+    QString metricsPath; // Hot path timers and counters after every generation, empty records none
+    GeneticMetrics::Format metricsFormat;
+    bool interactive; // Show images and pump the GUI event loop while running
 
+    // Read from inputPath and targetPath. Images set here beforehand are
+    // fitted instead when both paths and the manifest are empty.
     cv::Mat input;
     cv::Mat target;
 
     struct GeneticData {
         GeneticData();
         GeneticProgram *program;
-        cv::Mat output;
+        cv::Mat output; // Rendered on demand, only for the best individual
         qreal error;
 
         GeneticData& operator=(const GeneticData &source);
         ~GeneticData();
     };
 
-    class ResultsLog {
-    public:
-        ResultsLog(const QString &filePath);
-        void writeCurrentData(int generation, const QList<GeneticData*> &bestList);
-        QFile file;
-        QTextStream out;
-    };
-
     int population;
     int breedingPoolSize;
     int generations;
     int initialDepth;
+    int downscale; // Input and target are shrunk by this factor, 1 keeps full resolution
+    int pyramidLevels; // Offspring are screened on the coarser levels, 1 scores at full resolution only
+    qreal promotionRatio; // Share of candidates a level passes on to the next finer one
+    // Fitness planes per pyramid level, finest first, the last one repeating
+    // for coarser levels. Empty scores every level in float. Each reduced
+    // level is checked against float32 at the start and the difference reported.
+    QList<GeneticKernels::Precision> precisions;
+    int fitnessCacheSize; // Scores remembered across generations, per pyramid level; three times as many channel errors
+    qint64 subtreeCacheBudget; // Bytes of shared subtree planes per generation and island in tiled mode, 0 disables
+    GeneticProgram::EvaluationMode evaluationMode;
+    int threads; // Workers for breeding and scoring, shared by all islands, 0 uses every core
+    quint64 seed; // Master seed, a single island run is bit-reproducible for it whatever the thread count
 
-    QList<GeneticData*> bestList;
-    QList<GeneticData*> newBestList;
+    // Island model. Each island breeds its own population of the size above
+    // and sends copies of its migrantCount best to the next island every
+    // migrationInterval generations. Islands of one process run on their own
+    // threads and trade through in-process queues. With a socket path, the
+    // ring spans processCount processes started with the same settings and
+    // processIndex 0 to processCount - 1, trading over Unix datagrams.
+    int islandCount; // Per process, 1 is a single population on the GUI thread
+    int migrationInterval; // 0 never migrates
+    int migrantCount;
+    QString migrationSocketPath; // Island n binds path.n, empty keeps migration in process
+    int processIndex;
+    int processCount;
+
+    QList<GeneticData*> bestList; // Best first, owned by the island that bred it
 
     void analyse();
 
-public slots:
-    void start();
+private:
+    friend class GeneticIsland;
+
+    void runIsland(GeneticIsland *island, ResultsLog *logger);
+    void checkpoint(GeneticIsland *island); // Saves the island's pool if its generation is due
+    bool rescoresAfter(int generation) const; // Whether the pool ends that generation with full set errors
+    QString checkpointFile() const;
+    void reportPrecisionBounds();
+
+    TrainingSet trainingSet;
+    cv::Mat inputPlanes[3]; // The input once as CV_32F, shared read only by every program of every island
+    FitnessCache fitnessCache; // Shared by all islands
+    FitnessCache channelCache; // Per channel errors of the tiled and compiled modes, shared as well
+    WorkStealingPool *pool;
+    QList<GeneticIsland*> islands;
+    QList<MigrationChannel*> channels;
+
+    GeneticMetrics::Exporter *metricsExporter;
+    Checkpoint::Writer *checkpointWriter;
+    QMutex checkpointMutex;
+    QMap<int, QByteArray> checkpointSections; // Latest encoded island of each index
 };
 
 #endif // GENETICENGINE_H
@@ -0,0 +1,468 @@
+#include "geneticisland.h"
+#include "migrationchannel.h"
+#include "geneticmetrics.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QThread>
+#include <QVector>
+#include <qmath.h>
+#include <algorithm>
+#include <atomic>
+
+namespace {
+
+const char migrantVersion = 1; // First byte of every packet, bumped whenever the genome encoding changes
+
+}
+
+GeneticIsland::GeneticIsland(GeneticEngine *engine, int index, const GeneticRandom &random) :
+    index(index),
+    random(random),
+    currentGeneration(0),
+    incoming(0),
+    outgoing(0),
+    emigrants(0),
+    immigrants(0),
+    engine(engine)
+{
+}
+
+GeneticIsland::~GeneticIsland()
+{
+    qDeleteAll(bestList);
+    qDeleteAll(newBestList);
+}
+
+void GeneticIsland::firstGeneration()
+{
+    currentGeneration = 0;
+    arenas[0].reset();
+    evaluateGeneration(&GeneticIsland::createIndividual);
+}
+
+void GeneticIsland::nextGeneration()
+{
+    qDeleteAll(newBestList);
+    newBestList.clear();
+    newBestList = bestList; // Shallow copy data to new list
+    bestList.clear(); // Reset for next generation
+
+    // Migrants compete with the pool on the pairs it was scored on
+    window = engine->trainingSet.window(currentGeneration);
+    if (!window) { // The engine ends the run, the pool stays as it was
+        std::swap(bestList, newBestList);
+        return;
+    }
+    immigrate();
+
+    ++currentGeneration;
+
+    // The generation two back died with newBestList, so its arena is free
+    arenas[currentGeneration % 2].reset();
+
+    evaluateGeneration(&GeneticIsland::breedIndividual);
+
+    if (engine->migrationInterval > 0 && currentGeneration % engine->migrationInterval == 0)
+        emigrate();
+}
+
+void GeneticIsland::evaluateGeneration(GeneticData *(GeneticIsland::*individual)(int))
+{
+    WorkStealingPool *pool = engine->pool;
+    const int population = engine->population;
+    const int breedingPoolSize = engine->breedingPoolSize;
+
+    selection.setCapacity(breedingPoolSize);
+
+    // Planes are only kept for the generation that computed them
+    subtreeCache.clear();
+    subtreeCache.byteBudget = engine->subtreeCacheBudget;
+
+    // Only the island on the engine's thread reports progress and keeps the
+    // windows alive, the others would just interleave with it
+    const bool mainThread = (QThread::currentThread() == engine->thread());
+
+    // Batches only pace the event loop and progress output, the selection
+    // is independent of the order individuals finish in
+    const int batchSize = pool->workerCount() * 4;
+
+    GenomeArena *arena = &arenas[currentGeneration % 2];
+    window = engine->trainingSet.window(currentGeneration);
+    if (!window)
+        return; // The engine ends the run, see TrainingSet::error()
+    const int coarsest = int(window->levels.size()) - 1;
+
+    // Genome size against what is left to evaluate once simplified, over the
+    // offspring scored rather than answered by the fitness cache
+    std::atomic<qint64> genomeNodes(0);
+    std::atomic<qint64> evaluatedNodes(0);
+
+    auto countNodes = [&](const GeneticData *data) {
+        const int simplified = data->program->simplifiedSize();
+        if (simplified == 0)
+            return;
+        for (const auto& tree : data->program->m_genome)
+            genomeNodes += qint64(tree->code.size());
+        evaluatedNodes += simplified;
+    };
+
+    // Full resolution scoring goes straight into the selection, so it may
+    // abort as soon as an individual is certain not to make the pool.
+    // Offspring first scored here are counted before they may be dropped.
+    auto select = [&](GeneticData *data, int index, bool count) {
+        data->error = score(data, 0, selection.worstError());
+        if (count)
+            countNodes(data);
+        delete selection.insert(data, data->error, index);
+    };
+
+    QVector<GeneticData*> candidates(population);
+    GeneticData **candidateData = candidates.data(); // Detached once, workers write their own slot
+
+    for (int first = 0; first < population; first += batchSize) {
+        int count = qMin(batchSize, population - first);
+
+        pool->parallelFor(count, [&](int i) {
+            GenomeArena::Scope scope(arena);
+            GeneticData *data = (this->*individual)(first + i);
+
+            if (coarsest > 0) {
+                data->error = score(data, coarsest);
+                countNodes(data);
+                candidateData[first + i] = data;
+            } else {
+                select(data, first + i, true);
+            }
+        });
+
+        if (!mainThread)
+            continue;
+
+        if (engine->interactive)
+            QCoreApplication::processEvents();
+
+        QString progress = QString::number((double(first + count) / double(population)) * 100.00);
+
+        if (coarsest > 0)
+            qDebug() << progress << "%";
+        else
+            qDebug() << progress << "%" << selection.bestError();
+    }
+
+    // Each finer level only sees the best share of the level below it, and
+    // the last cut still leaves the whole breeding pool to choose from
+    QVector<int> survivors;
+    for (int i = 0; i < population && coarsest > 0; ++i)
+        survivors.append(i);
+
+    for (int level = coarsest - 1; level >= 0; --level) {
+        {
+            GeneticMetrics::Scope metrics(GeneticMetrics::Sort);
+            std::sort(survivors.begin(), survivors.end(), [&](int a, int b) {
+                qreal errorA = qIsNaN(candidates[a]->error) ? std::numeric_limits<qreal>::infinity() : candidates[a]->error;
+                qreal errorB = qIsNaN(candidates[b]->error) ? std::numeric_limits<qreal>::infinity() : candidates[b]->error;
+                return errorA < errorB || (errorA == errorB && a < b);
+            });
+        }
+
+        int promoted = qMin(survivors.size(), qMax(breedingPoolSize, qCeil(survivors.size() * engine->promotionRatio)));
+
+        for (int i = promoted; i < survivors.size(); ++i)
+            delete candidates[survivors[i]];
+        survivors.resize(promoted);
+
+        pool->parallelFor(promoted, [&](int i) {
+            GeneticData *data = candidates[survivors[i]];
+
+            if (level > 0)
+                data->error = score(data, level);
+            else
+                select(data, survivors[i], false);
+        });
+
+        if (mainThread)
+            qDebug() << "Level" << level << "promoted" << promoted;
+    }
+
+    {
+        GeneticMetrics::Scope metrics(GeneticMetrics::Sort);
+        bestList = selection.takeAll();
+    }
+
+    // Figures of every island go to the metrics file
+    if (!mainThread)
+        return;
+
+    qDebug() << "Island" << index << "generation" << currentGeneration
+             << "best error" << bestList.at(0)->error;
+    qDebug() << "Best tree depth" << bestList.at(0)->program->m_genome.at(0)->depthOfTree()
+             << "genome arena" << arena->bytesUsed() << "bytes"
+             << "peak RSS" << GeneticMetrics::peakResidentBytes() / (1 << 20) << "MiB";
+    qDebug() << "Nodes:" << genomeNodes.load() << "simplified:" << evaluatedNodes.load();
+
+    if (engine->evaluationMode == GeneticProgram::TiledEvaluation && engine->subtreeCacheBudget > 0) {
+        SubtreeCache::Stats stats = subtreeCache.stats();
+        qDebug() << "Subtree cache hits:" << stats.hits << "misses:" << stats.misses
+                 << "instructions saved:" << stats.instructionsSaved
+                 << "planes:" << stats.planes << "bytes:" << stats.bytesHeld;
+    }
+}
+
+GeneticIsland::GeneticData *GeneticIsland::createIndividual(int index)
+{
+    GeneticRandom random = individualRandom(index);
+
+    GeneticData *data = new GeneticData;
+    GeneticProgram *program = data->program;
+    program->setPlanes(engine->inputPlanes);
+    program->setMaxInitialDepth(engine->initialDepth);
+    program->setEvaluationMode(engine->evaluationMode);
+    program->setSubtreeCache(engine->subtreeCacheBudget > 0 ? &subtreeCache : 0);
+    program->setChannelCache(&engine->channelCache);
+    program->generateGenome(random);
+
+    return data;
+}
+
+GeneticIsland::GeneticData *GeneticIsland::breedIndividual(int index)
+{
+    GeneticRandom random = individualRandom(index);
+
+    const int breedingPoolSize = engine->breedingPoolSize;
+
+    int thisElement = index % breedingPoolSize;
+    int randomElement = random.bounded(breedingPoolSize);
+
+    while (randomElement == thisElement)
+        randomElement = random.bounded(breedingPoolSize);
+
+    const auto program1 = newBestList[thisElement]->program;
+    const auto program2 = newBestList[randomElement]->program;
+
+    Q_ASSERT(program1 && program2);
+
+    GeneticData *data = new GeneticData;
+    delete data->program;
+    data->program = program1->breedWithProgram(program2, random);
+
+    return data;
+}
+
+qreal GeneticIsland::score(GeneticData *data, int level, qreal abortAbove)
+{
+    return score(*window, data, level, abortAbove);
+}
+
+qreal GeneticIsland::score(const TrainingSet::Window &window, GeneticData *data, int level, qreal abortAbove)
+{
+    const TrainingSet::Level &fitness = window.levels[level];
+    // Scores only hold for the pairs they were measured on
+    const quint64 hash = data->program->structuralHash() ^ GeneticRandom::mix(quint64(window.id));
+    qreal error;
+
+    if (engine->fitnessCache.lookup(hash, level, abortAbove, &error))
+        return error;
+
+    const quint64 planesKey = ((quint64(window.id) << 8) | quint64(level)) + 1;
+
+    if (fitness.precision == GeneticKernels::Float32)
+        error = data->program->score(fitness.inputs, fitness.targets, abortAbove, planesKey);
+    else
+        error = data->program->score(fitness.packedInputs, fitness.packedTargets, abortAbove, planesKey, fitness.precision);
+
+    engine->fitnessCache.insert(hash, level, error, !(error > abortAbove));
+
+    return error;
+}
+
+void GeneticIsland::rescoreElites()
+{
+    if (!engine->trainingSet.isSampled() || bestList.isEmpty())
+        return;
+
+    if (!scoreOnFullSet(bestList))
+        return; // The engine ends the run, the errors stay as they were
+
+    GeneticMetrics::Scope metrics(GeneticMetrics::Sort);
+    std::stable_sort(bestList.begin(), bestList.end(), [](const GeneticData *a, const GeneticData *b) {
+        return a->error < b->error;
+    });
+}
+
+bool GeneticIsland::scoreOnFullSet(const QList<GeneticData*> &list)
+{
+    TrainingSet &trainingSet = engine->trainingSet;
+
+    // Pairs are weighted alike, whichever window they fall in
+    QVector<double> sums(list.size(), 0);
+    double *sum = sums.data();
+    int pairs = 0;
+
+    for (int i = 0; i < trainingSet.windowCount(); ++i) {
+        TrainingSet::WindowPointer full = trainingSet.fullWindow(i);
+        if (!full)
+            return false;
+
+        // Each window is seen once, so the budget goes to the one being scored
+        subtreeCache.clear();
+
+        engine->pool->parallelFor(list.size(), [&](int j) {
+            sum[j] += score(*full, list.at(j), 0) * full->pairs;
+        });
+
+        pairs += full->pairs;
+    }
+
+    // Nor are its planes of use to the next generation
+    subtreeCache.clear();
+
+    for (int i = 0; i < list.size(); ++i)
+        list.at(i)->error = sums.at(i) / pairs;
+
+    return true;
+}
+
+GeneticRandom GeneticIsland::individualRandom(int index) const
+{
+    return random.split((quint64(currentGeneration) << 32) | quint32(index));
+}
+
+GeneticIsland::GeneticData *GeneticIsland::decodeIndividual(const QByteArray &bytes)
+{
+    // Not bred in any arena, decoded individuals live on the heap
+    GeneticData *data = new GeneticData;
+    GeneticProgram *program = data->program;
+
+    if (!program->fromByteArray(bytes)) {
+        delete data;
+        return 0;
+    }
+
+    program->setPlanes(engine->inputPlanes);
+    program->setMaxInitialDepth(engine->initialDepth);
+    program->setEvaluationMode(engine->evaluationMode);
+    program->setSubtreeCache(engine->subtreeCacheBudget > 0 ? &subtreeCache : 0);
+    program->setChannelCache(&engine->channelCache);
+
+    return data;
+}
+
+Checkpoint::Island GeneticIsland::snapshot() const
+{
+    Checkpoint::Island state;
+    state.index = index;
+    state.generation = currentGeneration;
+    state.random = random;
+
+    for (const auto& data : bestList) {
+        Checkpoint::Individual individual;
+        individual.error = data->error;
+        individual.program = data->program->toByteArray();
+        state.individuals.append(individual);
+    }
+
+    return state;
+}
+
+bool GeneticIsland::restore(const Checkpoint::Island &state)
+{
+    if (state.individuals.size() < qMin(engine->breedingPoolSize, engine->population))
+        return false;
+
+    QList<GeneticData*> restored;
+
+    for (int i = 0; i < qMin(state.individuals.size(), engine->breedingPoolSize); ++i) {
+        GeneticData *data = decodeIndividual(state.individuals.at(i).program);
+
+        if (!data) {
+            qDeleteAll(restored);
+            return false;
+        }
+
+        data->error = state.individuals.at(i).error; // Output is rendered when first needed
+        restored.append(data);
+    }
+
+    qDeleteAll(bestList);
+    qDeleteAll(newBestList);
+    newBestList.clear();
+
+    bestList = restored;
+    currentGeneration = state.generation;
+    random = state.random;
+
+    return true;
+}
+
+void GeneticIsland::emigrate()
+{
+    if (!outgoing)
+        return;
+
+    // Copies of the best go out, the island keeps its own
+    for (int i = 0; i < qMin(engine->migrantCount, bestList.size()); ++i) {
+        QByteArray packet(1, migrantVersion);
+        packet.append(bestList.at(i)->program->toByteArray());
+
+        if (outgoing->send(packet))
+            ++emigrants;
+    }
+}
+
+void GeneticIsland::immigrate()
+{
+    if (!incoming)
+        return;
+
+    QList<GeneticData*> migrants;
+
+    for (const QByteArray &packet : incoming->receive()) {
+        GeneticData *data = 0;
+
+        if (packet.isEmpty() || packet.at(0) != migrantVersion || !(data = decodeIndividual(packet.mid(1)))) {
+            qWarning() << "Island" << index << "dropped a malformed migrant";
+            continue;
+        }
+
+        migrants.append(data);
+    }
+
+    if (migrants.isEmpty())
+        return;
+
+    // The sender's error is not trusted, another process may be looking at
+    // other images. Migrants are scored like the pool they compete with: on
+    // the full set if it was just rescored, on its window otherwise.
+    if (engine->rescoresAfter(currentGeneration + 1)) {
+        if (!scoreOnFullSet(migrants)) {
+            qDeleteAll(migrants);
+            return;
+        }
+    } else {
+        for (const auto& data : migrants) {
+            data->error = score(data, 0, newBestList.isEmpty() ? std::numeric_limits<qreal>::infinity()
+                                                               : newBestList.last()->error);
+        }
+    }
+
+    for (const auto& data : migrants) {
+        // A migrant takes the place of the worst parent it beats, so the
+        // breeding pool keeps its size and stays sorted
+        if (newBestList.size() >= engine->breedingPoolSize) {
+            if (!(data->error < newBestList.last()->error)) {
+                delete data;
+                continue;
+            }
+            delete newBestList.takeLast();
+        }
+
+        auto position = std::upper_bound(newBestList.begin(), newBestList.end(), data,
+                                         [](const GeneticData *a, const GeneticData *b) {
+            return a->error < b->error;
+        });
+        newBestList.insert(position, data);
+
+        ++immigrants;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef GENETICISLAND_H
+#define GENETICISLAND_H
+
+#include <QList>
+
+#include "geneticengine.h"
+#include "boundedselection.h"
+#include "genomearena.h"
+#include "subtreecache.h"
+
+class MigrationChannel;
+
+// One population and its breeding loop. The engine runs a single island
+// for a classic panmictic run, or several side by side that trade their
+// best individuals every migrationInterval generations. Islands share the
+// engine's images, fitness cache and worker pool.
+class GeneticIsland
+{
+public:
+    typedef GeneticEngine::GeneticData GeneticData;
+
+    GeneticIsland(GeneticEngine *engine, int index, const GeneticRandom &random);
+    ~GeneticIsland();
+
+    void firstGeneration();
+    void nextGeneration();
+
+    // Scores the breeding pool on the whole training set and sorts it again,
+    // so generations ranked on small batches do not drift on their noise.
+    // Nothing to do unless the set is sampled.
+    void rescoreElites();
+
+    Checkpoint::Island snapshot() const; // Breeding pool, generation and random stream
+    bool restore(const Checkpoint::Island &state); // False, and nothing changed, if the pool does not fit this run
+
+    int index; // Across every process of the run, migrants go to index + 1
+    GeneticRandom random; // Individuals split their own stream from it, it is never drawn from directly
+    int currentGeneration;
+
+    QList<GeneticData*> bestList; // Best first
+    QList<GeneticData*> newBestList;
+
+    // Not owned, either may be 0 for an island on its own
+    MigrationChannel *incoming;
+    MigrationChannel *outgoing;
+    int emigrants; // Sent, whether or not they arrived
+    int immigrants; // Received and good enough to join the breeding pool
+
+private:
+    Q_DISABLE_COPY(GeneticIsland)
+
+    void evaluateGeneration(GeneticData *(GeneticIsland::*individual)(int));
+    GeneticData *createIndividual(int index);
+    GeneticData *breedIndividual(int index);
+    qreal score(GeneticData *data, int level, qreal abortAbove = std::numeric_limits<qreal>::infinity()); // On the current window
+    qreal score(const TrainingSet::Window &window, GeneticData *data, int level, qreal abortAbove = std::numeric_limits<qreal>::infinity());
+    bool scoreOnFullSet(const QList<GeneticData*> &list); // Mean over every pair as their error, false if a window cannot be read
+    GeneticRandom individualRandom(int index) const;
+    GeneticData *decodeIndividual(const QByteArray &bytes); // 0 if bytes are not a genome
+    void emigrate();
+    void immigrate();
+
+    GeneticEngine *engine;
+    TrainingSet::WindowPointer window; // Pairs of the generation being scored
+    SubtreeCache subtreeCache;
+    ConcurrentBoundedSelection<GeneticData> selection; // Pool being filled by the current generation
+    GenomeArena arenas[2]; // Genomes of even and odd generations, a generation outlives its children by one
+};
+
+#endif // GENETICISLAND_H
@@ -0,0 +1,532 @@
+#include "geneticjit.h"
+#include "tileevaluator.h"
+#include "geneticmetrics.h"
+
+#include <QMutexLocker>
+#include <cstring>
+
+#if defined(Q_PROCESSOR_X86_64) && defined(Q_OS_UNIX)
+#define GENETIC_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+typedef GeneticTree::GeneticTreeItem Item;
+
+#ifdef GENETIC_JIT_SUPPORTED
+
+// Minimal x86-64 encoder for the handful of instructions the compiler emits.
+// Register use inside the generated loop:
+//   rdi matrix, rsi output, rdx byte count, rax byte offset
+//   xmm0 current four matrix pixels, xmm1/xmm2 scratch
+//   xmm3..xmm15 the first operator values on the stack, the rest spill to rsp
+class Assembler
+{
+public:
+    struct Operand {
+        enum Kind {
+            Register,
+            Stack,     // [rsp + value]
+            Constant,  // [rip + pool entry value]
+            Input,     // [rdi + rax]
+            Output     // [rsi + rax]
+        };
+        Kind kind;
+        int value;
+    };
+
+    enum SseOpcode {
+        MovupsLoad = 0x10,
+        MovupsStore = 0x11,
+        MovapsLoad = 0x28,
+        MovapsStore = 0x29,
+        Andps = 0x54,
+        Addps = 0x58,
+        Mulps = 0x59,
+        Subps = 0x5C,
+        Divps = 0x5E,
+        Cmpps = 0xC2
+    };
+
+    static const int firstValueRegister = 3;
+    static const int valueRegisters = 13;
+    static const int notEqualUnordered = 4;
+
+    static Operand reg(int xmm) { Operand o; o.kind = Operand::Register; o.value = xmm; return o; }
+    static Operand constant(int entry) { Operand o; o.kind = Operand::Constant; o.value = entry; return o; }
+    static Operand input() { Operand o; o.kind = Operand::Input; o.value = 0; return o; }
+    static Operand output() { Operand o; o.kind = Operand::Output; o.value = 0; return o; }
+
+    static Operand slot(int index)
+    {
+        if (index < valueRegisters)
+            return reg(firstValueRegister + index);
+
+        Operand o;
+        o.kind = Operand::Stack;
+        o.value = (index - valueRegisters) * 16;
+        return o;
+    }
+
+    void byte(uchar value) { bytes.push_back(value); }
+
+    void dword(qint32 value)
+    {
+        for (int i = 0; i < 4; ++i)
+            byte(uchar((quint32(value) >> (8 * i)) & 0xFF));
+    }
+
+    void patch(size_t position, qint32 value)
+    {
+        for (int i = 0; i < 4; ++i)
+            bytes[position + i] = uchar((quint32(value) >> (8 * i)) & 0xFF);
+    }
+
+    void sse(SseOpcode opcode, int xmm, const Operand &rm, int immediate = -1)
+    {
+        uchar rex = 0;
+        if (xmm >= 8)
+            rex |= 0x04; // REX.R
+        if (rm.kind == Operand::Register && rm.value >= 8)
+            rex |= 0x01; // REX.B
+        if (rex)
+            byte(0x40 | rex);
+
+        byte(0x0F);
+        byte(opcode);
+
+        const uchar modReg = uchar((xmm & 7) << 3);
+
+        switch (rm.kind) {
+        case Operand::Register:
+            byte(0xC0 | modReg | (rm.value & 7));
+            break;
+        case Operand::Stack:
+            byte(0x80 | modReg | 0x04);
+            byte(0x24); // SIB: base rsp, no index
+            dword(rm.value);
+            break;
+        case Operand::Constant: {
+            byte(modReg | 0x05); // rip-relative
+            Fixup fixup;
+            fixup.displacement = bytes.size();
+            fixup.entry = rm.value;
+            dword(0);
+            fixup.end = bytes.size() + (immediate >= 0 ? 1 : 0);
+            fixups.push_back(fixup);
+            break;
+        }
+        case Operand::Input:
+            byte(modReg | 0x04);
+            byte(0x07); // SIB: base rdi, index rax
+            break;
+        case Operand::Output:
+            byte(modReg | 0x04);
+            byte(0x06); // SIB: base rsi, index rax
+            break;
+        }
+
+        if (immediate >= 0)
+            byte(uchar(immediate));
+    }
+
+    void move(const Operand &dst, int xmm)
+    {
+        if (dst.kind == Operand::Register)
+            sse(MovapsLoad, dst.value, reg(xmm));
+        else
+            sse(MovapsStore, xmm, dst);
+    }
+
+    int constantEntry(float value)
+    {
+        quint32 bits;
+        memcpy(&bits, &value, sizeof(bits));
+
+        for (size_t i = 0; i < pool.size(); ++i) {
+            if (pool[i] == bits)
+                return int(i);
+        }
+
+        pool.push_back(bits);
+        return int(pool.size() - 1);
+    }
+
+    // Appends the 16-byte aligned constant pool and resolves rip-relative operands
+    void finish()
+    {
+        while (bytes.size() % 16)
+            byte(0xCC);
+
+        size_t poolStart = bytes.size();
+        for (quint32 bits : pool) {
+            for (int lane = 0; lane < 4; ++lane)
+                dword(qint32(bits));
+        }
+
+        for (const Fixup &fixup : fixups)
+            patch(fixup.displacement, qint32(poolStart + fixup.entry * 16 - fixup.end));
+    }
+
+    std::vector<uchar> bytes;
+
+private:
+    struct Fixup {
+        size_t displacement;
+        size_t end;
+        int entry;
+    };
+
+    std::vector<Fixup> fixups;
+    std::vector<quint32> pool;
+};
+
+static void emitConstantOperation(Assembler &a, int operation, float constant, bool reverseOrder)
+{
+    typedef Assembler A;
+
+    switch (operation) {
+    case Item::Add:
+        a.sse(A::MovapsLoad, 1, A::reg(0));
+        a.sse(A::Addps, 1, A::constant(a.constantEntry(constant)));
+        return;
+    case Item::Multiply:
+        a.sse(A::MovapsLoad, 1, A::reg(0));
+        a.sse(A::Mulps, 1, A::constant(a.constantEntry(constant)));
+        return;
+    case Item::Subtract:
+        if (reverseOrder) {
+            a.sse(A::MovapsLoad, 1, A::constant(a.constantEntry(constant)));
+            a.sse(A::Subps, 1, A::reg(0));
+        } else {
+            a.sse(A::MovapsLoad, 1, A::reg(0));
+            a.sse(A::Subps, 1, A::constant(a.constantEntry(constant)));
+        }
+        return;
+    case Item::Divide:
+        if (reverseOrder) {
+            a.sse(A::MovapsLoad, 2, A::reg(0));
+            a.sse(A::Cmpps, 2, A::constant(a.constantEntry(0)), A::notEqualUnordered);
+            a.sse(A::MovapsLoad, 1, A::constant(a.constantEntry(constant)));
+            a.sse(A::Divps, 1, A::reg(0));
+            a.sse(A::Andps, 1, A::reg(2));
+        } else {
+            a.sse(A::MovapsLoad, 1, A::reg(0));
+            a.sse(A::Mulps, 1, A::constant(a.constantEntry(1.0f / constant)));
+        }
+        return;
+    default: Q_ASSERT(false);
+    }
+}
+
+static void emitValueOperation(Assembler &a, int operation, const Assembler::Operand &value, bool reverseOrder)
+{
+    typedef Assembler A;
+
+    switch (operation) {
+    case Item::Add:
+        a.sse(A::MovapsLoad, 1, value);
+        a.sse(A::Addps, 1, A::reg(0));
+        return;
+    case Item::Multiply:
+        a.sse(A::MovapsLoad, 1, value);
+        a.sse(A::Mulps, 1, A::reg(0));
+        return;
+    case Item::Subtract:
+        if (reverseOrder) {
+            a.sse(A::MovapsLoad, 1, value);
+            a.sse(A::Subps, 1, A::reg(0));
+        } else {
+            a.sse(A::MovapsLoad, 1, A::reg(0));
+            a.sse(A::Subps, 1, value);
+        }
+        return;
+    case Item::Divide:
+        if (reverseOrder) {
+            a.sse(A::MovapsLoad, 2, A::reg(0));
+            a.sse(A::Cmpps, 2, A::constant(a.constantEntry(0)), A::notEqualUnordered);
+            a.sse(A::MovapsLoad, 1, value);
+            a.sse(A::Divps, 1, A::reg(0));
+        } else {
+            a.sse(A::MovapsLoad, 2, value);
+            a.sse(A::Cmpps, 2, A::constant(a.constantEntry(0)), A::notEqualUnordered);
+            a.sse(A::MovapsLoad, 1, A::reg(0));
+            a.sse(A::Divps, 1, value);
+        }
+        a.sse(A::Andps, 1, A::reg(2));
+        return;
+    default: Q_ASSERT(false);
+    }
+}
+
+static std::vector<uchar> compileCode(const GeneticTree::Code &code)
+{
+    typedef Assembler A;
+    Assembler a;
+
+    // sub rsp, imm32 (patched once the spill count is known)
+    a.byte(0x48); a.byte(0x81); a.byte(0xEC);
+    size_t frameSize = a.bytes.size();
+    a.dword(0);
+
+    a.byte(0x48); a.byte(0xC1); a.byte(0xE2); a.byte(0x02); // shl rdx, 2
+    a.byte(0x31); a.byte(0xC0);                             // xor eax, eax
+    a.byte(0x48); a.byte(0x39); a.byte(0xD0);               // cmp rax, rdx
+    a.byte(0x0F); a.byte(0x83);                             // jae done
+    size_t skipLoop = a.bytes.size();
+    a.dword(0);
+
+    size_t loopTop = a.bytes.size();
+    a.sse(A::MovupsLoad, 0, A::input());
+
+    struct Entry {
+        int type;
+        float constant;
+    };
+
+    std::vector<Entry> stack;
+    stack.reserve(code.size());
+    int live = 0; // Operator values currently on the stack
+    int maxLive = 0;
+
+    for (const auto& instruction : code) {
+        if (instruction.type != Item::Operator) {
+            Entry leaf;
+            leaf.type = instruction.type;
+            leaf.constant = instruction.constant;
+            stack.push_back(leaf);
+            continue;
+        }
+
+        Q_ASSERT(stack.size() >= 2);
+        Entry child2 = stack.back();
+        stack.pop_back();
+        Entry &child1 = stack.back();
+
+        int operation = instruction.operation;
+
+        // Same combination rules as GeneticTree::evaluateTree
+        if (operation == Item::Affine) {
+            a.sse(A::MovapsLoad, 1, A::reg(0));
+            a.sse(A::Mulps, 1, A::constant(a.constantEntry(child1.constant)));
+            a.sse(A::Addps, 1, A::constant(a.constantEntry(child2.constant)));
+            a.move(A::slot(live++), 1);
+        } else if (child1.type == Item::Constant && child2.type == Item::Matrix) {
+            emitConstantOperation(a, operation, child1.constant, true);
+            a.move(A::slot(live++), 1);
+        } else if (child1.type == Item::Matrix && child2.type == Item::Constant) {
+            emitConstantOperation(a, operation, child2.constant, false);
+            a.move(A::slot(live++), 1);
+        } else if (child1.type == Item::Constant && child2.type == Item::Operator) {
+            emitConstantOperation(a, operation, child1.constant, true);
+            a.move(A::slot(live - 1), 1);
+        } else if (child1.type == Item::Operator && child2.type == Item::Constant) {
+            emitConstantOperation(a, operation, child2.constant, false);
+            a.move(A::slot(live - 1), 1);
+        } else if (child1.type == Item::Matrix && child2.type == Item::Operator) {
+            emitValueOperation(a, operation, A::slot(live - 1), true);
+            a.move(A::slot(live - 1), 1);
+        } else if (child1.type == Item::Operator && child2.type == Item::Matrix) {
+            emitValueOperation(a, operation, A::slot(live - 1), false);
+            a.move(A::slot(live - 1), 1);
+        } else if (child1.type == Item::Operator && child2.type == Item::Operator) {
+            a.sse(A::MovapsLoad, 1, A::slot(live - 1));
+            a.move(A::slot(live - 2), 1);
+            --live;
+        } else {
+            a.sse(A::MovapsLoad, 1, A::reg(0));
+            a.move(A::slot(live++), 1);
+        }
+
+        maxLive = qMax(maxLive, live);
+        child1.type = Item::Operator;
+    }
+
+    Q_ASSERT(stack.size() == 1 && live == 1);
+    a.sse(A::MovupsStore, A::firstValueRegister, A::output());
+
+    a.byte(0x48); a.byte(0x83); a.byte(0xC0); a.byte(0x10); // add rax, 16
+    a.byte(0x48); a.byte(0x39); a.byte(0xD0);               // cmp rax, rdx
+    a.byte(0x0F); a.byte(0x82);                             // jb loopTop
+    a.dword(qint32(loopTop - (a.bytes.size() + 4)));
+
+    a.patch(skipLoop, qint32(a.bytes.size() - (skipLoop + 4)));
+
+    // Keep rsp 16-byte aligned for the spilled values
+    int spills = qMax(0, maxLive - A::valueRegisters);
+    qint32 frame = 8 + 16 * spills;
+    a.patch(frameSize, frame);
+
+    a.byte(0x48); a.byte(0x81); a.byte(0xC4); // add rsp, imm32
+    a.dword(frame);
+    a.byte(0xC3);                             // ret
+
+    a.finish();
+    return a.bytes;
+}
+
+#endif // GENETIC_JIT_SUPPORTED
+
+static QByteArray cacheKey(const GeneticTree::Code &code)
+{
+    QByteArray key;
+    key.reserve(int(code.size() * 6));
+
+    for (const auto& instruction : code) {
+        key.append(char(instruction.type));
+        key.append(char(instruction.operation));
+        if (instruction.type == Item::Constant)
+            key.append(reinterpret_cast<const char*>(&instruction.constant), sizeof(float));
+    }
+
+    return key;
+}
+
+GeneticJit::CompiledTree::CompiledTree() :
+    function(0),
+    memory(0),
+    size(0)
+{
+}
+
+GeneticJit::CompiledTree::~CompiledTree()
+{
+#ifdef GENETIC_JIT_SUPPORTED
+    if (memory)
+        munmap(memory, size);
+#endif
+}
+
+GeneticJit::GeneticJit() :
+    cacheLimit(4096),
+    compilations(0),
+    cacheHits(0)
+{
+}
+
+bool GeneticJit::isSupported()
+{
+#ifdef GENETIC_JIT_SUPPORTED
+    return true;
+#else
+    return false;
+#endif
+}
+
+GeneticJit &GeneticJit::instance()
+{
+    static GeneticJit jit;
+    return jit;
+}
+
+QSharedPointer<GeneticJit::CompiledTree> GeneticJit::compile(const GeneticTree::Code &code)
+{
+    QSharedPointer<CompiledTree> compiled;
+
+#ifdef GENETIC_JIT_SUPPORTED
+    QByteArray key = cacheKey(code);
+
+    {
+        QMutexLocker locker(&mutex);
+        auto cached = cache.constFind(key);
+        if (cached != cache.constEnd()) {
+            ++cacheHits;
+            GeneticMetrics::add(GeneticMetrics::JitCacheHits);
+            return cached.value();
+        }
+    }
+
+    std::vector<uchar> bytes = compileCode(code);
+
+    compiled = QSharedPointer<CompiledTree>(new CompiledTree);
+    compiled->size = bytes.size();
+    compiled->memory = mmap(0, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (compiled->memory == MAP_FAILED) {
+        compiled->memory = 0;
+        return QSharedPointer<CompiledTree>();
+    }
+
+    memcpy(compiled->memory, bytes.data(), bytes.size());
+
+    // Never writable and executable at the same time
+    if (mprotect(compiled->memory, bytes.size(), PROT_READ | PROT_EXEC) != 0)
+        return QSharedPointer<CompiledTree>();
+
+    compiled->function = reinterpret_cast<Function>(compiled->memory);
+
+    QMutexLocker locker(&mutex);
+    ++compilations;
+    GeneticMetrics::add(GeneticMetrics::JitCompilations);
+
+    if (!cache.contains(key)) {
+        cache.insert(key, compiled);
+        cacheOrder.append(key);
+    }
+
+    // Evaluations still running keep their own reference to evicted trees
+    while (cacheOrder.size() > cacheLimit)
+        cache.remove(cacheOrder.takeFirst());
+#else
+    Q_UNUSED(code);
+#endif
+
+    return compiled;
+}
+
+cv::Mat GeneticJit::evaluate(const GeneticTree::Code &code, const cv::Mat &matrix)
+{
+    Q_ASSERT(matrix.type() == CV_32F);
+
+    cv::Mat output(matrix.rows, matrix.cols, CV_32F);
+
+    if (matrix.isContinuous()) {
+        evaluate(code, matrix.ptr<float>(), output.ptr<float>(), matrix.rows * matrix.cols);
+        return output;
+    }
+
+    for (int row = 0; row < matrix.rows; ++row)
+        evaluate(code, matrix.ptr<float>(row), output.ptr<float>(row), matrix.cols);
+
+    return output;
+}
+
+void GeneticJit::evaluate(const GeneticTree::Code &code, const float *matrix, float *output, int count)
+{
+    QSharedPointer<CompiledTree> compiled = compile(code);
+    int vectorCount = compiled ? (count & ~3) : 0;
+
+    if (vectorCount)
+        compiled->function(matrix, output, vectorCount);
+
+    // Remainder pixels, or everything if compilation was not possible
+    if (vectorCount < count)
+        TileEvaluator().evaluate(code, matrix + vectorCount, output + vectorCount, count - vectorCount);
+}
+
+double GeneticJit::sumAbsoluteError(const GeneticTree::Code &code, const float *matrix, const float *target, int count, double abortAbove)
+{
+    QSharedPointer<CompiledTree> compiled = compile(code);
+
+    if (!compiled)
+        return TileEvaluator().sumAbsoluteError(code, matrix, target, count, abortAbove);
+
+    // Small enough to stay in L1 between the tree and the error kernel
+    const int blockSize = 1024;
+    float output[blockSize];
+    const GeneticKernels::Table &kernels = GeneticKernels::table();
+    double sum = 0;
+
+    for (int offset = 0; offset < count && sum <= abortAbove; offset += blockSize) {
+        int n = qMin(blockSize, count - offset);
+        int vectorCount = n & ~3;
+
+        if (vectorCount)
+            compiled->function(matrix + offset, output, vectorCount);
+        if (vectorCount < n)
+            TileEvaluator().evaluate(code, matrix + offset + vectorCount, output + vectorCount, n - vectorCount);
+
+        sum += kernels.absoluteError(output, target + offset, n);
+    }
+
+    return sum;
+}
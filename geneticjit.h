@@ -0,0 +1,56 @@
+#ifndef GENETICJIT_H
+#define GENETICJIT_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <limits>
+
+#include "genetictree.h"
+
+// Compiles a postfix genome into straight-line x86-64 SSE code in
+// executable memory, four pixels per loop iteration with no per-node
+// dispatch. Compiled trees are cached by their code, so unchanged trees
+// (copies, parents bred with themselves, analyse() probes) never recompile.
+class GeneticJit
+{
+public:
+    // count must be a multiple of four
+    typedef void (*Function)(const float *matrix, float *output, qint64 count);
+
+    class CompiledTree
+    {
+    public:
+        CompiledTree();
+        ~CompiledTree();
+        Function function;
+        void *memory;
+        size_t size;
+    };
+
+    static bool isSupported();
+    static GeneticJit &instance();
+
+    QSharedPointer<CompiledTree> compile(const GeneticTree::Code &code);
+    cv::Mat evaluate(const GeneticTree::Code &code, const cv::Mat &matrix);
+    void evaluate(const GeneticTree::Code &code, const float *matrix, float *output, int count);
+    // As TileEvaluator::sumAbsoluteError
+    double sumAbsoluteError(const GeneticTree::Code &code, const float *matrix, const float *target, int count,
+                            double abortAbove = std::numeric_limits<double>::infinity());
+
+    int cacheLimit;
+    quint64 compilations;
+    quint64 cacheHits;
+
+private:
+    GeneticJit();
+    Q_DISABLE_COPY(GeneticJit)
+
+    QMutex mutex;
+    QHash<QByteArray, QSharedPointer<CompiledTree> > cache;
+    QList<QByteArray> cacheOrder; // Oldest first
+};
+
+#endif // GENETICJIT_H
@@ -0,0 +1,584 @@
+#include "genetickernels.h"
+#include "genetictree.h"
+
+#include <QElapsedTimer>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define GENETIC_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+typedef GeneticTree::GeneticTreeItem Item;
+
+// Scalar kernels, also used for the tail of every vectorised loop.
+// Division by a zero pixel gives 0 like cv::divide, dividing by a constant
+// multiplies by its reciprocal like cv::MatExpr.
+
+template <int operation, bool reverseOrder>
+static void scalarConstantKernel(float *dst, const float *matrix, float constant, int count)
+{
+    const float scale = 1.0f / constant;
+
+    for (int i = 0; i < count; ++i) {
+        const float m = matrix[i];
+        switch (operation) {
+        case Item::Add: dst[i] = m + constant; break;
+        case Item::Divide: dst[i] = reverseOrder ? (m != 0 ? constant / m : 0) : m * scale; break;
+        case Item::Multiply: dst[i] = m * constant; break;
+        default: dst[i] = reverseOrder ? constant - m : m - constant; break;
+        }
+    }
+}
+
+template <int operation, bool reverseOrder>
+static void scalarValueKernel(float *dst, const float *value, const float *matrix, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        const float v = value[i];
+        const float m = matrix[i];
+        switch (operation) {
+        case Item::Add: dst[i] = v + m; break;
+        case Item::Divide: dst[i] = reverseOrder ? (m != 0 ? v / m : 0) : (v != 0 ? m / v : 0); break;
+        case Item::Multiply: dst[i] = v * m; break;
+        default: dst[i] = reverseOrder ? v - m : m - v; break;
+        }
+    }
+}
+
+static void scalarAffineKernel(float *dst, const float *matrix, float scale, float offset, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        const float scaled = matrix[i] * scale; // Rounded on its own, like the JIT's mulps + addps
+        dst[i] = scaled + offset;
+    }
+}
+
+static float scalarAbsoluteErrorKernel(const float *output, const float *target, int count)
+{
+    float total = 0;
+
+    for (int i = 0; i < count; ++i)
+        total += std::fabs(output[i] - target[i]);
+
+    return total;
+}
+
+// Half floats with round to nearest even, after F. Giesen's float_to_half_fast3_rtne
+static quint16 floatToHalf(float value)
+{
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    const quint32 sign = bits & 0x80000000u;
+    bits ^= sign;
+    quint16 half;
+
+    if (bits >= quint32(127 + 16) << 23) {
+        half = bits > quint32(255) << 23 ? 0x7E00 : 0x7C00; // NaN, or infinite and too large alike
+    } else if (bits < quint32(113) << 23) {
+        // Subnormal or zero, the addition rounds the mantissa into place
+        const quint32 magicBits = quint32((127 - 15) + (23 - 10) + 1) << 23;
+        float magic;
+        memcpy(&magic, &magicBits, sizeof(magic));
+        float shifted;
+        memcpy(&shifted, &bits, sizeof(shifted));
+        shifted += magic;
+        memcpy(&bits, &shifted, sizeof(bits));
+        half = quint16(bits - magicBits);
+    } else {
+        const quint32 odd = (bits >> 13) & 1;
+        bits += (quint32(15 - 127) << 23) + 0xFFF + odd;
+        half = quint16(bits >> 13);
+    }
+
+    return quint16(half | (sign >> 16));
+}
+
+static float halfToFloat(quint16 half)
+{
+    const quint32 sign = quint32(half & 0x8000) << 16;
+    const quint32 exponent = (half >> 10) & 0x1F;
+    const quint32 mantissa = half & 0x3FF;
+    quint32 bits;
+
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000u | (mantissa << 13);
+    } else if (exponent) {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else {
+        const float subnormal = float(mantissa) * (1.0f / 16777216.0f); // mantissa * 2^-24
+        return sign ? -subnormal : subnormal;
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void scalarHalfKernel(float *dst, const quint16 *half, int count)
+{
+    for (int i = 0; i < count; ++i)
+        dst[i] = halfToFloat(half[i]);
+}
+
+#define FILL_KERNEL_OPERATION(table, operation) \
+    table.constantKernels[operation][0] = constantKernel<operation, false>; \
+    table.constantKernels[operation][1] = constantKernel<operation, true>; \
+    table.valueKernels[operation][0] = valueKernel<operation, false>; \
+    table.valueKernels[operation][1] = valueKernel<operation, true>;
+
+#define FILL_KERNEL_TABLE(table) \
+    FILL_KERNEL_OPERATION(table, Item::Add) \
+    FILL_KERNEL_OPERATION(table, Item::Divide) \
+    FILL_KERNEL_OPERATION(table, Item::Multiply) \
+    FILL_KERNEL_OPERATION(table, Item::Subtract) \
+    table.affine = affineKernel; \
+    table.absoluteError = absoluteErrorKernel; \
+    table.halfToFloat = halfKernel;
+
+namespace ScalarKernels {
+
+template <int operation, bool reverseOrder>
+static void constantKernel(float *dst, const float *matrix, float constant, int count)
+{
+    scalarConstantKernel<operation, reverseOrder>(dst, matrix, constant, count);
+}
+
+template <int operation, bool reverseOrder>
+static void valueKernel(float *dst, const float *value, const float *matrix, int count)
+{
+    scalarValueKernel<operation, reverseOrder>(dst, value, matrix, count);
+}
+
+static void affineKernel(float *dst, const float *matrix, float scale, float offset, int count)
+{
+    scalarAffineKernel(dst, matrix, scale, offset, count);
+}
+
+static float absoluteErrorKernel(const float *output, const float *target, int count)
+{
+    return scalarAbsoluteErrorKernel(output, target, count);
+}
+
+static void halfKernel(float *dst, const quint16 *half, int count)
+{
+    scalarHalfKernel(dst, half, count);
+}
+
+static GeneticKernels::Table makeTable(GeneticKernels::Isa isa)
+{
+    GeneticKernels::Table table;
+    table.isa = isa;
+    FILL_KERNEL_TABLE(table);
+    return table;
+}
+
+} // namespace ScalarKernels
+
+#ifdef GENETIC_KERNELS_X86
+
+// SSE4.2
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("sse4.2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#endif
+
+#define SIMD_NAMESPACE Sse42Kernels
+#define SIMD_TYPE __m128
+#define SIMD_WIDTH 4
+#define SIMD_LOAD _mm_loadu_ps
+#define SIMD_STORE _mm_storeu_ps
+#define SIMD_SET1 _mm_set1_ps
+#define SIMD_ADD _mm_add_ps
+#define SIMD_SUB _mm_sub_ps
+#define SIMD_MUL _mm_mul_ps
+#define SIMD_ABS(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), a)
+#define SIMD_SAFE_DIV(a, b) _mm_and_ps(_mm_div_ps(a, b), _mm_cmpneq_ps(b, _mm_setzero_ps()))
+#include "genetickernels_simd.h"
+#undef SIMD_NAMESPACE
+#undef SIMD_TYPE
+#undef SIMD_WIDTH
+#undef SIMD_LOAD
+#undef SIMD_STORE
+#undef SIMD_SET1
+#undef SIMD_ADD
+#undef SIMD_SUB
+#undef SIMD_MUL
+#undef SIMD_ABS
+#undef SIMD_SAFE_DIV
+#undef SIMD_HALF_LOAD
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+// AVX2
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx2,f16c"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,f16c")
+#endif
+
+#define SIMD_NAMESPACE Avx2Kernels
+#define SIMD_TYPE __m256
+#define SIMD_WIDTH 8
+#define SIMD_LOAD _mm256_loadu_ps
+#define SIMD_STORE _mm256_storeu_ps
+#define SIMD_SET1 _mm256_set1_ps
+#define SIMD_ADD _mm256_add_ps
+#define SIMD_SUB _mm256_sub_ps
+#define SIMD_MUL _mm256_mul_ps
+#define SIMD_ABS(a) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a)
+#define SIMD_SAFE_DIV(a, b) _mm256_and_ps(_mm256_div_ps(a, b), _mm256_cmp_ps(b, _mm256_setzero_ps(), _CMP_NEQ_UQ))
+#define SIMD_HALF_LOAD(p) _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))) // Every AVX2 CPU has F16C
+#include "genetickernels_simd.h"
+#undef SIMD_NAMESPACE
+#undef SIMD_TYPE
+#undef SIMD_WIDTH
+#undef SIMD_LOAD
+#undef SIMD_STORE
+#undef SIMD_SET1
+#undef SIMD_ADD
+#undef SIMD_SUB
+#undef SIMD_MUL
+#undef SIMD_ABS
+#undef SIMD_SAFE_DIV
+#undef SIMD_HALF_LOAD
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+// AVX-512
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+
+#define SIMD_NAMESPACE Avx512Kernels
+#define SIMD_TYPE __m512
+#define SIMD_WIDTH 16
+#define SIMD_LOAD _mm512_loadu_ps
+#define SIMD_STORE _mm512_storeu_ps
+#define SIMD_SET1 _mm512_set1_ps
+#define SIMD_ADD _mm512_add_ps
+#define SIMD_SUB _mm512_sub_ps
+#define SIMD_MUL _mm512_mul_ps
+#define SIMD_ABS _mm512_abs_ps
+#define SIMD_SAFE_DIV(a, b) _mm512_maskz_div_ps(_mm512_cmp_ps_mask(b, _mm512_setzero_ps(), _CMP_NEQ_UQ), a, b)
+#define SIMD_HALF_LOAD(p) _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)))
+#include "genetickernels_simd.h"
+#undef SIMD_NAMESPACE
+#undef SIMD_TYPE
+#undef SIMD_WIDTH
+#undef SIMD_LOAD
+#undef SIMD_STORE
+#undef SIMD_SET1
+#undef SIMD_ADD
+#undef SIMD_SUB
+#undef SIMD_MUL
+#undef SIMD_ABS
+#undef SIMD_SAFE_DIV
+#undef SIMD_HALF_LOAD
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#endif // GENETIC_KERNELS_X86
+
+// Saturating fixed point. Sums and products are formed in 32 bits and
+// clamped once, so only the stored result saturates.
+namespace FixedKernels {
+
+const qint32 one = 1 << GeneticKernels::fixedFractionBits;
+
+static inline qint16 saturate(qint64 value)
+{
+    return qint16(qBound(qint64(-32768), value, qint64(32767)));
+}
+
+static inline qint16 fixedValue(float value)
+{
+    return qint16(qBound(-32768.0f, std::round(value * one), 32767.0f)); // NaN ends up at the upper bound
+}
+
+// A constant factor as a 16 bit multiplier and a right shift, with as many
+// fraction bits as its size leaves room for
+struct Factor {
+    explicit Factor(float constant) : shift(15)
+    {
+        while (shift > 0 && !(std::fabs(constant) * float(1 << shift) <= 32767.0f))
+            --shift;
+        multiplier = qint32(qBound(-32767.0f, std::round(constant * float(1 << shift)), 32767.0f));
+        rounding = shift > 0 ? qint32(1) << (shift - 1) : 0;
+    }
+
+    qint32 apply(qint32 value) const
+    {
+        return (value * multiplier + rounding) >> shift;
+    }
+
+    int shift;
+    qint32 multiplier;
+    qint32 rounding;
+};
+
+template <int operation, bool reverseOrder>
+static void constantKernel(qint16 *dst, const qint16 *matrix, float constant, int count)
+{
+    switch (operation) {
+    case Item::Add:
+    case Item::Subtract: {
+        const qint32 c = fixedValue(constant);
+        for (int i = 0; i < count; ++i) {
+            const qint32 m = matrix[i];
+            dst[i] = saturate(operation == Item::Add ? m + c : (reverseOrder ? c - m : m - c));
+        }
+        break;
+    }
+    case Item::Multiply: {
+        const Factor factor(constant);
+        for (int i = 0; i < count; ++i)
+            dst[i] = saturate(factor.apply(matrix[i]));
+        break;
+    }
+    default:
+        if (!reverseOrder) {
+            const Factor factor(1.0f / constant); // Like the float kernels, a reciprocal
+            for (int i = 0; i < count; ++i)
+                dst[i] = saturate(factor.apply(matrix[i]));
+        } else {
+            // constant / (m / one) in fixed point is constant * one * one / m
+            const qint64 numerator = qint64(qBound(-1e15f, std::round(constant * one * one), 1e15f));
+            for (int i = 0; i < count; ++i)
+                dst[i] = matrix[i] ? saturate(numerator / matrix[i]) : 0;
+        }
+        break;
+    }
+}
+
+template <int operation, bool reverseOrder>
+static void valueKernel(qint16 *dst, const qint16 *value, const qint16 *matrix, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        const qint32 v = value[i];
+        const qint32 m = matrix[i];
+        switch (operation) {
+        case Item::Add: dst[i] = saturate(v + m); break;
+        case Item::Divide:
+            if (reverseOrder)
+                dst[i] = m ? saturate(v * one / m) : 0;
+            else
+                dst[i] = v ? saturate(m * one / v) : 0;
+            break;
+        case Item::Multiply: dst[i] = saturate((v * m + one / 2) >> GeneticKernels::fixedFractionBits); break;
+        default: dst[i] = saturate(reverseOrder ? v - m : m - v); break;
+        }
+    }
+}
+
+static void affineKernel(qint16 *dst, const qint16 *matrix, float scale, float offset, int count)
+{
+    const Factor factor(scale);
+    const qint32 c = fixedValue(offset);
+
+    for (int i = 0; i < count; ++i)
+        dst[i] = saturate(qint64(factor.apply(matrix[i])) + c);
+}
+
+static float absoluteErrorKernel(const qint16 *output, const qint16 *target, int count)
+{
+    qint64 total = 0;
+
+    for (int i = 0; i < count; ++i)
+        total += qAbs(qint32(output[i]) - qint32(target[i]));
+
+    return float(total) / one;
+}
+
+static GeneticKernels::FixedTable makeTable()
+{
+    GeneticKernels::FixedTable table;
+    FILL_KERNEL_OPERATION(table, Item::Add)
+    FILL_KERNEL_OPERATION(table, Item::Divide)
+    FILL_KERNEL_OPERATION(table, Item::Multiply)
+    FILL_KERNEL_OPERATION(table, Item::Subtract)
+    table.affine = affineKernel;
+    table.absoluteError = absoluteErrorKernel;
+    return table;
+}
+
+} // namespace FixedKernels
+
+GeneticKernels::Isa GeneticKernels::detectIsa()
+{
+#ifdef GENETIC_KERNELS_X86
+    // CPUID, including the OS support bits for the wider register files
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return SSE42;
+#endif
+    return Scalar;
+}
+
+const GeneticKernels::Table *GeneticKernels::table(GeneticKernels::Isa isa)
+{
+    static const Isa supported = detectIsa();
+
+    if (isa > supported)
+        return 0;
+
+    static const Table scalarTable = ScalarKernels::makeTable(Scalar);
+
+    switch (isa) {
+#ifdef GENETIC_KERNELS_X86
+    case SSE42: {
+        static const Table sse42Table = Sse42Kernels::makeTable(SSE42);
+        return &sse42Table;
+    }
+    case AVX2: {
+        static const Table avx2Table = Avx2Kernels::makeTable(AVX2);
+        return &avx2Table;
+    }
+    case AVX512: {
+        static const Table avx512Table = Avx512Kernels::makeTable(AVX512);
+        return &avx512Table;
+    }
+#endif
+    default:
+        return &scalarTable;
+    }
+}
+
+const GeneticKernels::Table &GeneticKernels::table()
+{
+    static const Table *best = table(detectIsa());
+    return *best;
+}
+
+QString GeneticKernels::isaName(GeneticKernels::Isa isa)
+{
+    switch (isa) {
+    case Scalar: return "Scalar";
+    case SSE42: return "SSE4.2";
+    case AVX2: return "AVX2";
+    case AVX512: return "AVX-512";
+    default: return "Undefined";
+    }
+}
+
+QList<GeneticKernels::Throughput> GeneticKernels::benchmark(int pixels)
+{
+    QList<Throughput> results;
+
+    std::vector<float> matrix(pixels);
+    std::vector<float> value(pixels);
+    std::vector<float> dst(pixels);
+
+    for (int i = 0; i < pixels; ++i) {
+        matrix[i] = float(i % 256);
+        value[i] = float((i * 7) % 255) + 1;
+    }
+
+    for (int isa = Scalar; isa <= AVX512; ++isa) {
+        const Table *kernels = table(static_cast<Isa>(isa));
+        if (!kernels)
+            break;
+
+        // Every operator and operand order once, so the mix matches no tree in particular
+        const int repeats = 4;
+        QElapsedTimer timer;
+        timer.start();
+
+        for (int r = 0; r < repeats; ++r) {
+            for (int operation = 0; operation < 4; ++operation) {
+                for (int reverseOrder = 0; reverseOrder < 2; ++reverseOrder) {
+                    kernels->constantKernels[operation][reverseOrder](dst.data(), matrix.data(), 0.5f, pixels);
+                    kernels->valueKernels[operation][reverseOrder](dst.data(), value.data(), matrix.data(), pixels);
+                }
+            }
+        }
+
+        qint64 nanoseconds = qMax(qint64(1), timer.nsecsElapsed());
+
+        Throughput throughput;
+        throughput.isa = kernels->isa;
+        throughput.pixelsPerSecond = (double(pixels) * repeats * 16) / (double(nanoseconds) / 1e9);
+        results.append(throughput);
+    }
+
+    return results;
+}
+
+const GeneticKernels::FixedTable &GeneticKernels::fixedTable()
+{
+    static const FixedTable table = FixedKernels::makeTable();
+    return table;
+}
+
+QString GeneticKernels::precisionName(GeneticKernels::Precision precision)
+{
+    switch (precision) {
+    case Float32: return "float32";
+    case Float16: return "float16";
+    case Fixed16: return "fixed16";
+    default: return "undefined";
+    }
+}
+
+bool GeneticKernels::parsePrecision(const QString &name, GeneticKernels::Precision *precision)
+{
+    for (int i = Float32; i <= Fixed16; ++i) {
+        if (name == precisionName(Precision(i))) {
+            *precision = Precision(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+cv::Mat GeneticKernels::pack(const cv::Mat &plane, GeneticKernels::Precision precision)
+{
+    Q_ASSERT(plane.type() == CV_32F);
+
+    if (precision == Float32)
+        return plane;
+
+    cv::Mat packed(plane.rows, plane.cols, precision == Float16 ? CV_16U : CV_16S);
+
+    for (int row = 0; row < plane.rows; ++row) {
+        const float *in = plane.ptr<float>(row);
+
+        if (precision == Float16) {
+            quint16 *out = packed.ptr<quint16>(row);
+            for (int i = 0; i < plane.cols; ++i)
+                out[i] = floatToHalf(in[i]);
+        } else {
+            qint16 *out = packed.ptr<qint16>(row);
+            for (int i = 0; i < plane.cols; ++i)
+                out[i] = FixedKernels::fixedValue(in[i]);
+        }
+    }
+
+    return packed;
+}
@@ -0,0 +1,86 @@
+#ifndef GENETICKERNELS_H
+#define GENETICKERNELS_H
+
+#include <QList>
+#include <QString>
+#include <opencv/cxcore.hpp>
+
+// Per-pixel kernels for the tree operators, vectorised once per instruction
+// set. The widest set the CPU reports is picked at runtime, so the same
+// binary runs on every machine.
+class GeneticKernels
+{
+public:
+    enum Isa {
+        Scalar,
+        SSE42,
+        AVX2,
+        AVX512
+    };
+
+    // constant o matrix, or matrix o constant when reverseOrder is false
+    typedef void (*ConstantKernel)(float *dst, const float *matrix, float constant, int count);
+    // subtree o matrix, or matrix o subtree when reverseOrder is false
+    typedef void (*ValueKernel)(float *dst, const float *value, const float *matrix, int count);
+    // scale * matrix + offset, for the Affine operation of simplified code
+    typedef void (*AffineKernel)(float *dst, const float *matrix, float scale, float offset, int count);
+    // Sum of |output - target|
+    typedef float (*ErrorKernel)(const float *output, const float *target, int count);
+    // IEEE half floats, stored as quint16, widened to float
+    typedef void (*HalfKernel)(float *dst, const quint16 *half, int count);
+
+    struct Table {
+        Isa isa;
+        ConstantKernel constantKernels[4][2]; // [GeneticTreeItem::Operations][reverseOrder]
+        ValueKernel valueKernels[4][2];
+        AffineKernel affine;
+        ErrorKernel absoluteError;
+        HalfKernel halfToFloat; // F16C with AVX2 and up
+    };
+
+    // Fitness planes can be stored narrower than float for screening,
+    // halving what each node reads from memory
+    enum Precision {
+        Float32, // CV_32F planes
+        Float16, // Half float planes (CV_16U bits), widened per tile and computed in float
+        Fixed16  // Saturating fixed point planes (CV_16S) and arithmetic, fixedFractionBits below the point
+    };
+
+    // Pixels run to 255 and expressions scale them further, so 10 integer
+    // bits saturate at +-1024 and leave a resolution of 1/32
+    static const int fixedFractionBits = 5;
+
+    typedef void (*FixedConstantKernel)(qint16 *dst, const qint16 *matrix, float constant, int count);
+    typedef void (*FixedValueKernel)(qint16 *dst, const qint16 *value, const qint16 *matrix, int count);
+    typedef void (*FixedAffineKernel)(qint16 *dst, const qint16 *matrix, float scale, float offset, int count);
+    typedef float (*FixedErrorKernel)(const qint16 *output, const qint16 *target, int count); // In pixel units
+
+    // Same layout as Table, so TileEvaluator runs either. Plain loops the
+    // compiler vectorises for the baseline instruction set.
+    struct FixedTable {
+        FixedConstantKernel constantKernels[4][2];
+        FixedValueKernel valueKernels[4][2];
+        FixedAffineKernel affine;
+        FixedErrorKernel absoluteError;
+    };
+
+    struct Throughput {
+        Isa isa;
+        double pixelsPerSecond;
+    };
+
+    static const Table &table(); // Widest supported instruction set
+    static const Table *table(Isa isa); // Null if the CPU or compiler lacks it
+    static Isa detectIsa();
+    static QString isaName(Isa isa);
+    static QList<Throughput> benchmark(int pixels = 1 << 20); // Per supported instruction set, for GeneticBenchmark
+
+    static const FixedTable &fixedTable();
+    static QString precisionName(Precision precision);
+    static bool parsePrecision(const QString &name, Precision *precision);
+    // A CV_32F plane in the storage of precision, CV_16U half bits or CV_16S
+    // fixed point; Float32 planes are returned as they are
+    static cv::Mat pack(const cv::Mat &plane, Precision precision);
+};
+
+#endif // GENETICKERNELS_H
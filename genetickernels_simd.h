@@ -0,0 +1,100 @@
+// Kernel bodies for one instruction set. genetickernels.cpp includes this
+// once per set with the SIMD_* macros and the matching target pragma.
+
+namespace SIMD_NAMESPACE {
+
+template <int operation, bool reverseOrder>
+static inline SIMD_TYPE constantStep(SIMD_TYPE matrix, SIMD_TYPE constant, SIMD_TYPE scale)
+{
+    switch (operation) {
+    case GeneticTree::GeneticTreeItem::Add: return SIMD_ADD(matrix, constant);
+    case GeneticTree::GeneticTreeItem::Divide: return reverseOrder ? SIMD_SAFE_DIV(constant, matrix) : SIMD_MUL(matrix, scale);
+    case GeneticTree::GeneticTreeItem::Multiply: return SIMD_MUL(matrix, constant);
+    default: return reverseOrder ? SIMD_SUB(constant, matrix) : SIMD_SUB(matrix, constant);
+    }
+}
+
+template <int operation, bool reverseOrder>
+static inline SIMD_TYPE valueStep(SIMD_TYPE value, SIMD_TYPE matrix)
+{
+    switch (operation) {
+    case GeneticTree::GeneticTreeItem::Add: return SIMD_ADD(value, matrix);
+    case GeneticTree::GeneticTreeItem::Divide: return reverseOrder ? SIMD_SAFE_DIV(value, matrix) : SIMD_SAFE_DIV(matrix, value);
+    case GeneticTree::GeneticTreeItem::Multiply: return SIMD_MUL(value, matrix);
+    default: return reverseOrder ? SIMD_SUB(value, matrix) : SIMD_SUB(matrix, value);
+    }
+}
+
+template <int operation, bool reverseOrder>
+static void constantKernel(float *dst, const float *matrix, float constant, int count)
+{
+    const SIMD_TYPE c = SIMD_SET1(constant);
+    const SIMD_TYPE scale = SIMD_SET1(1.0f / constant);
+
+    int i = 0;
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+        SIMD_STORE(dst + i, (constantStep<operation, reverseOrder>(SIMD_LOAD(matrix + i), c, scale)));
+
+    scalarConstantKernel<operation, reverseOrder>(dst + i, matrix + i, constant, count - i);
+}
+
+template <int operation, bool reverseOrder>
+static void valueKernel(float *dst, const float *value, const float *matrix, int count)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+        SIMD_STORE(dst + i, (valueStep<operation, reverseOrder>(SIMD_LOAD(value + i), SIMD_LOAD(matrix + i))));
+
+    scalarValueKernel<operation, reverseOrder>(dst + i, value + i, matrix + i, count - i);
+}
+
+static void affineKernel(float *dst, const float *matrix, float scale, float offset, int count)
+{
+    const SIMD_TYPE a = SIMD_SET1(scale);
+    const SIMD_TYPE b = SIMD_SET1(offset);
+
+    int i = 0;
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+        SIMD_STORE(dst + i, SIMD_ADD(SIMD_MUL(SIMD_LOAD(matrix + i), a), b));
+
+    scalarAffineKernel(dst + i, matrix + i, scale, offset, count - i);
+}
+
+static float absoluteErrorKernel(const float *output, const float *target, int count)
+{
+    SIMD_TYPE sum = SIMD_SET1(0.0f);
+
+    int i = 0;
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+        sum = SIMD_ADD(sum, SIMD_ABS(SIMD_SUB(SIMD_LOAD(output + i), SIMD_LOAD(target + i))));
+
+    float lanes[SIMD_WIDTH];
+    SIMD_STORE(lanes, sum);
+
+    float total = scalarAbsoluteErrorKernel(output + i, target + i, count - i);
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+        total += lanes[lane];
+
+    return total;
+}
+
+static void halfKernel(float *dst, const quint16 *half, int count)
+{
+    int i = 0;
+#ifdef SIMD_HALF_LOAD
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+        SIMD_STORE(dst + i, SIMD_HALF_LOAD(half + i));
+#endif
+
+    scalarHalfKernel(dst + i, half + i, count - i);
+}
+
+static GeneticKernels::Table makeTable(GeneticKernels::Isa isa)
+{
+    GeneticKernels::Table table;
+    table.isa = isa;
+    FILL_KERNEL_TABLE(table);
+    return table;
+}
+
+} // namespace SIMD_NAMESPACE
@@ -0,0 +1,237 @@
+#include "geneticmetrics.h"
+
+#include <QIODevice>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QTextStream>
+#include <chrono>
+#include <vector>
+
+std::atomic<bool> GeneticMetrics::enabled(false);
+QMutex GeneticMetrics::slotMutex;
+std::vector<GeneticMetrics::Slot*> GeneticMetrics::threadSlots;
+thread_local GeneticMetrics::Slot *GeneticMetrics::currentSlot = 0;
+
+GeneticMetrics::Totals::Totals()
+{
+    for (int i = 0; i < PhaseCount; ++i) {
+        nanoseconds[i] = 0;
+        calls[i] = 0;
+    }
+    for (int i = 0; i < CounterCount; ++i)
+        counters[i] = 0;
+}
+
+GeneticMetrics::Slot::Slot()
+{
+    for (int i = 0; i < PhaseCount; ++i) {
+        nanoseconds[i].store(0);
+        calls[i].store(0);
+        depth[i] = 0;
+    }
+    for (int i = 0; i < CounterCount; ++i)
+        counters[i].store(0);
+}
+
+void GeneticMetrics::enable()
+{
+    enabled.store(true);
+}
+
+GeneticMetrics::Slot *GeneticMetrics::threadSlot()
+{
+    if (!currentSlot) {
+        currentSlot = new Slot;
+        QMutexLocker locker(&slotMutex);
+        threadSlots.push_back(currentSlot);
+    }
+
+    return currentSlot;
+}
+
+qint64 GeneticMetrics::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void GeneticMetrics::Scope::begin()
+{
+    Slot *slot = threadSlot();
+    open = true;
+
+    if (slot->depth[phase]++ == 0)
+        start = now();
+}
+
+void GeneticMetrics::Scope::end()
+{
+    Slot *slot = threadSlot();
+
+    if (--slot->depth[phase] == 0) {
+        increment(slot->nanoseconds[phase], quint64(now() - start));
+        increment(slot->calls[phase], 1);
+    }
+}
+
+QList<GeneticMetrics::Totals> GeneticMetrics::threadTotals()
+{
+    QMutexLocker locker(&slotMutex);
+    QList<Totals> totals;
+
+    for (const Slot *slot : threadSlots) {
+        Totals thread;
+
+        for (int i = 0; i < PhaseCount; ++i) {
+            thread.nanoseconds[i] = slot->nanoseconds[i].load(std::memory_order_relaxed);
+            thread.calls[i] = slot->calls[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < CounterCount; ++i)
+            thread.counters[i] = slot->counters[i].load(std::memory_order_relaxed);
+
+        totals.append(thread);
+    }
+
+    return totals;
+}
+
+quint64 GeneticMetrics::peakResidentBytes()
+{
+    QFile status("/proc/self/status");
+    if (!status.open(QIODevice::ReadOnly))
+        return 0;
+
+    // "VmHWM:    123456 kB"
+    for (QByteArray line = status.readLine(); !line.isEmpty(); line = status.readLine()) {
+        if (line.startsWith("VmHWM:"))
+            return line.mid(6).trimmed().split(' ').first().toULongLong() * 1024;
+    }
+
+    return 0;
+}
+
+const char *GeneticMetrics::phaseName(Phase phase)
+{
+    static const char *const names[PhaseCount] = {
+        "tree_growth", "tree_copy", "item_copy", "breed", "mutate", "evaluate", "score", "sort", "log_write"
+    };
+    return names[phase];
+}
+
+const char *GeneticMetrics::counterName(Counter counter)
+{
+    static const char *const names[CounterCount] = {
+        "nodes_evaluated", "pixels_processed", "allocations", "fitness_cache_hits", "fitness_cache_misses",
+        "channel_cache_hits", "channel_cache_misses",
+        "subtree_cache_hits", "subtree_cache_misses", "jit_compilations", "jit_cache_hits"
+    };
+    return names[counter];
+}
+
+GeneticMetrics::Exporter::Exporter(const QString &path, Format format) :
+    path(path),
+    format(format),
+    file(path),
+    open(false)
+{
+    if (format == JsonLines) {
+        open = file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    } else {
+        QSaveFile probe(path); // Nothing is committed, an existing file stays as it is
+        open = probe.open(QIODevice::WriteOnly);
+        probe.cancelWriting();
+    }
+}
+
+bool GeneticMetrics::Exporter::isOpen() const
+{
+    return open;
+}
+
+bool GeneticMetrics::Exporter::write(int generation, int island)
+{
+    QMutexLocker locker(&mutex);
+
+    const QList<Totals> totals = threadTotals();
+    generations[island] = generation;
+    QString text;
+    QTextStream out(&text);
+
+    if (format == JsonLines) {
+        // Several islands share the pool, so a line covers whatever its
+        // thread did for any island since the previous write
+        for (int thread = 0; thread < totals.size(); ++thread) {
+            const Totals &current = totals.at(thread);
+            const Totals before = thread < previous.size() ? previous.at(thread) : Totals();
+            QString fields;
+            bool idle = true;
+
+            for (int i = 0; i < PhaseCount; ++i) {
+                const quint64 calls = current.calls[i] - before.calls[i];
+                if (!calls)
+                    continue;
+                idle = false;
+                fields += QString(",\"%1_calls\":%2,\"%1_ns\":%3").arg(phaseName(Phase(i)))
+                        .arg(calls).arg(current.nanoseconds[i] - before.nanoseconds[i]);
+            }
+            for (int i = 0; i < CounterCount; ++i) {
+                const quint64 count = current.counters[i] - before.counters[i];
+                if (!count)
+                    continue;
+                idle = false;
+                fields += QString(",\"%1\":%2").arg(counterName(Counter(i))).arg(count);
+            }
+
+            if (!idle)
+                out << "{\"generation\":" << generation << ",\"island\":" << island << ",\"thread\":" << thread << fields << "}\n";
+        }
+
+        previous = totals;
+        out.flush();
+
+        const QByteArray data = text.toUtf8();
+        return file.write(data) == data.size() && file.flush();
+    }
+
+    out << "# HELP genetic_phase_seconds_total Time spent in each phase, nested phases included.\n"
+        << "# TYPE genetic_phase_seconds_total counter\n";
+    for (int thread = 0; thread < totals.size(); ++thread) {
+        for (int i = 0; i < PhaseCount; ++i) {
+            out << "genetic_phase_seconds_total{phase=\"" << phaseName(Phase(i)) << "\",thread=\"" << thread << "\"} "
+                << QString::number(totals.at(thread).nanoseconds[i] / 1e9, 'g', 12) << "\n";
+        }
+    }
+
+    out << "# HELP genetic_phase_calls_total Times each phase was entered.\n"
+        << "# TYPE genetic_phase_calls_total counter\n";
+    for (int thread = 0; thread < totals.size(); ++thread) {
+        for (int i = 0; i < PhaseCount; ++i) {
+            out << "genetic_phase_calls_total{phase=\"" << phaseName(Phase(i)) << "\",thread=\"" << thread << "\"} "
+                << totals.at(thread).calls[i] << "\n";
+        }
+    }
+
+    out << "# HELP genetic_events_total Hot path counters.\n"
+        << "# TYPE genetic_events_total counter\n";
+    for (int thread = 0; thread < totals.size(); ++thread) {
+        for (int i = 0; i < CounterCount; ++i) {
+            out << "genetic_events_total{counter=\"" << counterName(Counter(i)) << "\",thread=\"" << thread << "\"} "
+                << totals.at(thread).counters[i] << "\n";
+        }
+    }
+
+    out << "# HELP genetic_generation Latest finished generation of each island.\n"
+        << "# TYPE genetic_generation gauge\n";
+    for (auto it = generations.constBegin(); it != generations.constEnd(); ++it)
+        out << "genetic_generation{island=\"" << it.key() << "\"} " << it.value() << "\n";
+
+    out.flush();
+    previous = totals;
+
+    // Replaced whole, so a scraper never reads half a file
+    const QByteArray data = text.toUtf8();
+    QSaveFile output(path);
+    if (!output.open(QIODevice::WriteOnly) || output.write(data) != data.size())
+        return false;
+    return output.commit();
+}
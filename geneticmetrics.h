@@ -0,0 +1,144 @@
+#ifndef GENETICMETRICS_H
+#define GENETICMETRICS_H
+
+#include <QFile>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <atomic>
+#include <vector>
+
+// Scoped timers and counters on the hot paths, kept per thread so that
+// recording never contends. Nothing is recorded until enable(); until then
+// every hook is one branch on a flag. Enabled, a scope costs two clock
+// reads and a counter a relaxed add on the thread's own slot.
+//
+// Phases nest, e.g. Evaluate inside Score, and their times are inclusive.
+// A phase entered again while it is open, e.g. by recursion, is timed once.
+class GeneticMetrics
+{
+public:
+    enum Phase {
+        TreeGrowth,  // GeneticTree::generateTree
+        TreeCopy,    // GeneticTree::operator=
+        ItemCopy,    // GeneticTreeItem deep copies
+        Breed,       // GeneticTree::breedWithTree
+        Mutate,      // GeneticTree::mutateRandomChild
+        Evaluate,    // Rendering whole planes
+        Score,       // Error against the target, fused with evaluation when tiled or compiled
+        Sort,        // Ranking candidates and the breeding pool
+        LogWrite,    // ResultsLog I/O
+        PhaseCount
+    };
+
+    enum Counter {
+        NodesEvaluated,  // Instructions of every plane evaluated, once per plane
+        PixelsProcessed, // Pixels of every plane evaluated
+        Allocations,     // Genome code allocations, arena or heap
+        FitnessCacheHits,
+        FitnessCacheMisses,
+        ChannelCacheHits,
+        ChannelCacheMisses,
+        SubtreeCacheHits,
+        SubtreeCacheMisses,
+        JitCompilations,
+        JitCacheHits,
+        CounterCount
+    };
+
+    struct Totals {
+        Totals();
+        quint64 nanoseconds[PhaseCount];
+        quint64 calls[PhaseCount];
+        quint64 counters[CounterCount];
+    };
+
+    static void enable(); // Recording stays on for the rest of the process
+    static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+    static void add(Counter counter, quint64 amount = 1)
+    {
+        if (isEnabled())
+            increment(threadSlot()->counters[counter], amount);
+    }
+
+    class Scope
+    {
+    public:
+        explicit Scope(Phase phase) : phase(phase), open(false), start(0)
+        {
+            if (isEnabled())
+                begin();
+        }
+
+        ~Scope()
+        {
+            if (open)
+                end();
+        }
+
+    private:
+        Q_DISABLE_COPY(Scope)
+        void begin();
+        void end();
+
+        Phase phase;
+        bool open;
+        qint64 start; // Only set by the outermost scope of the phase
+    };
+
+    static QList<Totals> threadTotals(); // Per thread that recorded anything, in order of first use
+    static quint64 peakResidentBytes(); // High water mark of the process from /proc, 0 where unavailable
+    static const char *phaseName(Phase phase);
+    static const char *counterName(Counter counter);
+
+    enum Format {
+        JsonLines,  // Appends a line per thread with what it did since the previous write
+        Prometheus  // Rewrites the file with running totals, for a scraper
+    };
+
+    class Exporter
+    {
+    public:
+        Exporter(const QString &path, Format format);
+        bool isOpen() const; // Checked once, a failed write later only returns false
+        bool write(int generation, int island); // After each island's generation, islands may call at once
+
+    private:
+        Q_DISABLE_COPY(Exporter)
+
+        QString path;
+        Format format;
+        QFile file; // JSON lines only, Prometheus files are replaced whole
+        bool open;
+        QMutex mutex;
+        QList<Totals> previous;
+        QMap<int, int> generations; // Latest generation of each island
+    };
+
+private:
+    struct Slot {
+        Slot();
+        std::atomic<quint64> nanoseconds[PhaseCount];
+        std::atomic<quint64> calls[PhaseCount];
+        std::atomic<quint64> counters[CounterCount];
+        int depth[PhaseCount]; // Open scopes, only touched by the owning thread
+    };
+
+    // Only the owning thread writes a slot, so no locked instruction is needed
+    static void increment(std::atomic<quint64> &value, quint64 amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    static Slot *threadSlot();
+    static qint64 now();
+
+    static std::atomic<bool> enabled;
+    static QMutex slotMutex;
+    static std::vector<Slot*> threadSlots; // Outlive their threads, so finished workers are still exported
+    static thread_local Slot *currentSlot;
+};
+
+#endif // GENETICMETRICS_H
@@ -1,12 +1,23 @@
 #include "geneticprogram.h"
+#include "tileevaluator.h"
+#include "geneticjit.h"
+#include "geneticmetrics.h"
+#include "fitnesscache.h"
 
 #include <QDebug>
-#include <QThread>
+#include <QFile>
+#include <QSaveFile>
+#include <QtEndian>
 #include <qmath.h>
+#include <cstring>
 
 GeneticProgram::GeneticProgram(QObject *parent) :
     QObject(parent),
-    maxDepth(100)
+    maxDepth(100),
+    m_evaluationMode(ReferenceEvaluation),
+    m_subtreeCache(0),
+    m_channelCache(0),
+    m_simplifiedSize(0)
 {
     for (int i = 0; i < 3; ++i) {
         GeneticTree *tree = new GeneticTree;
@@ -22,13 +33,37 @@ GeneticProgram::~GeneticProgram()
 
 bool GeneticProgram::setMatrix(cv::Mat matrix)
 {
-    if (matrix.channels() < 3)
+    cv::Mat planes[3];
+    if (!splitPlanes(matrix, planes))
         return false;
 
-    split(matrix, m_matrix);
+    setPlanes(planes);
+    return true;
+}
 
-    for (int i = 0; i < 3; ++i)
-        m_genome[i]->setMatrix(m_matrix[i].clone());
+void GeneticProgram::setPlanes(const cv::Mat planes[3])
+{
+    for (int i = 0; i < 3; ++i) {
+        Q_ASSERT(planes[i].type() == CV_32F);
+        m_matrix[i] = planes[i];
+        m_genome[i]->setMatrix(planes[i]);
+    }
+}
+
+bool GeneticProgram::splitPlanes(const cv::Mat &image, cv::Mat planes[3])
+{
+    if (image.channels() < 3)
+        return false;
+
+    // Converted into new planes, planes may hold ones that others share
+    std::vector<cv::Mat> channels;
+    cv::split(image, channels);
+
+    for (int i = 0; i < 3; ++i) {
+        cv::Mat plane;
+        channels[i].convertTo(plane, CV_32F);
+        planes[i] = plane;
+    }
 
     return true;
 }
@@ -38,26 +73,28 @@ void GeneticProgram::setMaxInitialDepth(uint depth)
     maxDepth = depth;
 }
 
-bool GeneticProgram::generateGenome()
+bool GeneticProgram::generateGenome(GeneticRandom &random)
 {
     for (const auto& tree : m_genome) {
-        QThread::msleep(1);
         tree->maxInitialDepth = maxDepth;
-        tree->generateTree();
+        tree->generateTree(random);
     }
 
     return true;
 }
 
-GeneticProgram* GeneticProgram::breedWithProgram(GeneticProgram  * const program)
+GeneticProgram* GeneticProgram::breedWithProgram(GeneticProgram  * const program, GeneticRandom &random)
 {
     GeneticProgram *child = new GeneticProgram;
+    child->m_evaluationMode = m_evaluationMode;
+    child->m_subtreeCache = m_subtreeCache;
+    child->m_channelCache = m_channelCache;
 
     for (int i = 0; i < 3; ++i) {
-        child->m_matrix[i] = m_matrix[i].clone();
-        GeneticTree *baby = m_genome[i]->breedWithTree(program->m_genome[i]);
-        if (!(qrand() % 5)) {// Temporary mutation rate (20%)
-                baby->mutateRandomChild(baby);
+        child->m_matrix[i] = m_matrix[i];
+        GeneticTree *baby = m_genome[i]->breedWithTree(program->m_genome[i], random);
+        if (!random.bounded(5)) {// Temporary mutation rate (20%)
+                baby->mutateRandomChild(baby, random);
 
         }
 
@@ -71,13 +108,28 @@ GeneticProgram* GeneticProgram::breedWithProgram(GeneticProgram  * const program
 
 cv::Mat GeneticProgram::evaluate()
 {
+    GeneticMetrics::Scope metrics(GeneticMetrics::Evaluate);
     cv::Mat bgr[3];
 
     Q_ASSERT(m_genome[0] && m_genome[1] && m_genome[2]);
 
-    for (int i = 0; i < 3; ++i) {
-        cv::Mat debugger = m_genome[i]->evaluateTree();
-        bgr[i] = debugger;
+    if (m_evaluationMode == TiledEvaluation) {
+        TileEvaluator evaluator;
+        for (int i = 0; i < 3; ++i) {
+            const GeneticTree *tree = m_genome[i];
+            bgr[i] = evaluator.evaluate(GeneticTree::simplify(tree->code), tree->matrix);
+        }
+    } else if (m_evaluationMode == JitEvaluation && GeneticJit::isSupported()) {
+        GeneticJit &jit = GeneticJit::instance();
+        for (int i = 0; i < 3; ++i) {
+            const GeneticTree *tree = m_genome[i];
+            bgr[i] = jit.evaluate(GeneticTree::simplify(tree->code), tree->matrix);
+        }
+    } else {
+        for (int i = 0; i < 3; ++i) {
+            cv::Mat debugger = m_genome[i]->evaluateTree();
+            bgr[i] = debugger;
+        }
     }
 
     cv::Mat output;
@@ -87,6 +139,308 @@ cv::Mat GeneticProgram::evaluate()
     return output;
 }
 
+qreal GeneticProgram::score(const cv::Mat target[3], qreal abortAbove)
+{
+    const cv::Mat input[3] = { m_genome[0]->matrix, m_genome[1]->matrix, m_genome[2]->matrix };
+    return score(input, target, abortAbove);
+}
+
+qreal GeneticProgram::score(const cv::Mat input[3], const cv::Mat target[3], qreal abortAbove)
+{
+    GeneticTree::Code code[3];
+    m_simplifiedSize = 0;
+    for (int i = 0; i < 3; ++i) {
+        code[i] = GeneticTree::simplify(m_genome[i]->code);
+        m_simplifiedSize += int(code[i].size());
+    }
+
+    return scorePair(input, target, code, 0, abortAbove);
+}
+
+qreal GeneticProgram::score(const std::vector<cv::Mat> &inputs, const std::vector<cv::Mat> &targets, qreal abortAbove, quint64 planesKey,
+                            GeneticKernels::Precision precision)
+{
+    Q_ASSERT(!inputs.empty() && inputs.size() % 3 == 0 && inputs.size() == targets.size());
+
+    // Simplified once for every pair
+    GeneticTree::Code code[3];
+    m_simplifiedSize = 0;
+    for (int i = 0; i < 3; ++i) {
+        code[i] = GeneticTree::simplify(m_genome[i]->code);
+        m_simplifiedSize += int(code[i].size());
+    }
+
+    const int pairs = int(inputs.size() / 3);
+    const qreal abortSum = abortAbove * pairs;
+    qreal sum = 0;
+
+    // Errors are never negative, so the mean is settled once the sum passes abortSum
+    for (int i = 0; i < pairs && !(sum > abortSum); ++i) {
+        const quint64 pairKey = planesKey ? GeneticRandom::mix((planesKey + quint64(i) * Q_UINT64_C(0x9E3779B97F4A7C15))
+                                                               ^ (quint64(precision) << 56)) | 1 : 0;
+        sum += scorePair(&inputs[3 * i], &targets[3 * i], code, pairKey, abortSum - sum, precision);
+    }
+
+    return sum / pairs;
+}
+
+qreal GeneticProgram::scorePair(const cv::Mat input[3], const cv::Mat target[3], const GeneticTree::Code code[3],
+                                quint64 pairKey, qreal abortAbove, GeneticKernels::Precision precision)
+{
+    GeneticMetrics::Scope metrics(GeneticMetrics::Score);
+    qreal error = 0;
+
+    // The reference evaluator runs the whole genome, dead code included, and
+    // stays the baseline that the faster modes are checked against
+    const bool cached = m_channelCache && pairKey && m_evaluationMode != ReferenceEvaluation;
+    const int type = precision == GeneticKernels::Float16 ? CV_16U : (precision == GeneticKernels::Fixed16 ? CV_16S : CV_32F);
+
+    for (int i = 0; i < 3; ++i) {
+        GeneticTree *tree = m_genome[i];
+        const cv::Mat &matrix = input[i];
+
+        Q_ASSERT(matrix.type() == type);
+        Q_ASSERT(target[i].type() == type && target[i].size() == matrix.size());
+
+        // Channels have planes of their own, so the channel goes in as the level
+        const quint64 hash = cached ? GeneticTree::structuralHash(code[i]) ^ pairKey : 0;
+        qreal channelError;
+
+        if (cached && m_channelCache->lookup(hash, i, abortAbove, &channelError)) {
+            error = qMax(error, channelError);
+            if (error > abortAbove)
+                break;
+            continue;
+        }
+
+        const double pixels = double(matrix.rows) * matrix.cols;
+        const double abortSum = abortAbove * pixels;
+        double sum = 0;
+
+        // The reference evaluator only knows the tree's own matrix, other
+        // inputs go through the tile evaluator, which gives the same result
+        if (m_evaluationMode == ReferenceEvaluation && precision == GeneticKernels::Float32 && matrix.data == tree->matrix.data) {
+            sum = cv::norm(tree->evaluateTree(), target[i], cv::NORM_L1);
+        } else {
+            int rows = matrix.rows;
+            int cols = matrix.cols;
+
+            if (matrix.isContinuous() && target[i].isContinuous()) {
+                cols *= rows;
+                rows = 1;
+            }
+
+            const bool jit = (m_evaluationMode == JitEvaluation && GeneticJit::isSupported());
+            TileEvaluator evaluator;
+            evaluator.subtreeCache = m_subtreeCache;
+            evaluator.planesKey = pairKey ? pairKey + quint64(i) : 0;
+            GeneticMetrics::add(GeneticMetrics::NodesEvaluated, code[i].size());
+
+            for (int row = 0; row < rows && sum <= abortSum; ++row) {
+                GeneticMetrics::add(GeneticMetrics::PixelsProcessed, cols);
+
+                if (precision == GeneticKernels::Float16) {
+                    sum += evaluator.sumAbsoluteErrorHalf(code[i], matrix.ptr<quint16>(row), target[i].ptr<quint16>(row),
+                                                          cols, abortSum - sum);
+                } else if (precision == GeneticKernels::Fixed16) {
+                    sum += evaluator.sumAbsoluteErrorFixed(code[i], matrix.ptr<qint16>(row), target[i].ptr<qint16>(row),
+                                                           cols, abortSum - sum);
+                } else if (jit) {
+                    sum += GeneticJit::instance().sumAbsoluteError(code[i], matrix.ptr<float>(row), target[i].ptr<float>(row),
+                                                                   cols, abortSum - sum);
+                } else {
+                    sum += evaluator.sumAbsoluteError(code[i], matrix.ptr<float>(row), target[i].ptr<float>(row),
+                                                      cols, abortSum - sum);
+                }
+            }
+        }
+
+        channelError = sum / pixels;
+        if (cached)
+            m_channelCache->insert(hash, i, channelError, !(channelError > abortAbove));
+
+        error = qMax(error, channelError);
+
+        if (error > abortAbove)
+            break;
+    }
+
+    return error;
+}
+
+quint64 GeneticProgram::structuralHash() const
+{
+    quint64 hash = 0;
+
+    // Channels are not interchangeable, so each tree's hash is folded in order
+    for (const auto& tree : m_genome)
+        hash = (hash * Q_UINT64_C(0x100000001B3)) ^ GeneticTree::structuralHash(tree->code);
+
+    return hash;
+}
+
+int GeneticProgram::simplifiedSize() const
+{
+    return m_simplifiedSize;
+}
+
+QByteArray GeneticProgram::toByteArray() const
+{
+    typedef GeneticTree::GeneticTreeItem Item;
+
+    QByteArray data;
+
+    for (const auto& tree : m_genome) {
+        uchar count[4];
+        qToLittleEndian<quint32>(quint32(tree->code.size()), count);
+        data.append(reinterpret_cast<const char*>(count), 4);
+
+        for (const auto& instruction : tree->code) {
+            data.append(char(instruction.type | (instruction.operation << 2)));
+
+            if (instruction.type == Item::Constant) {
+                quint32 bits;
+                memcpy(&bits, &instruction.constant, 4);
+                uchar constant[4];
+                qToLittleEndian<quint32>(bits, constant);
+                data.append(reinterpret_cast<const char*>(constant), 4);
+            }
+        }
+    }
+
+    return data;
+}
+
+bool GeneticProgram::fromByteArray(const QByteArray &data)
+{
+    typedef GeneticTree::GeneticTreeItem Item;
+
+    const uchar *p = reinterpret_cast<const uchar*>(data.constData());
+    const uchar *end = p + data.size();
+    GeneticTree::Code codes[3];
+
+    for (auto& code : codes) {
+        if (end - p < 4)
+            return false;
+
+        quint32 count = qFromLittleEndian<quint32>(p);
+        p += 4;
+
+        // Grown trees have an operator over two operands at the root
+        if (count < 3 || count > quint32(end - p))
+            return false;
+
+        code.reserve(count);
+        int depth = 0;
+
+        for (quint32 i = 0; i < count; ++i) {
+            if (p == end)
+                return false;
+
+            GeneticTree::Instruction instruction;
+            instruction.type = *p & 3;
+            instruction.operation = *p >> 2;
+            instruction.constant = 0;
+            ++p;
+
+            // Affine is only ever emitted by simplify(), never part of a genome
+            if (instruction.type > Item::Operator || instruction.operation >= Item::Affine)
+                return false;
+
+            if (instruction.type == Item::Constant) {
+                if (end - p < 4)
+                    return false;
+                quint32 bits = qFromLittleEndian<quint32>(p);
+                memcpy(&instruction.constant, &bits, 4);
+                p += 4;
+            }
+
+            // Operands must precede their operator
+            depth += (instruction.type == Item::Operator) ? -1 : 1;
+            if (depth < 1)
+                return false;
+
+            code.push_back(instruction);
+        }
+
+        if (depth != 1 || code.back().type != Item::Operator)
+            return false;
+    }
+
+    if (p != end)
+        return false;
+
+    for (int i = 0; i < 3; ++i)
+        m_genome[i]->code = codes[i];
+    m_simplifiedSize = 0;
+
+    return true;
+}
+
+namespace {
+const char programMagic[4] = { 'G', 'E', 'P', 'R' };
+}
+
+bool GeneticProgram::save(const QString &path) const
+{
+    QByteArray data(programMagic, 4);
+    uchar version[4];
+    qToLittleEndian<quint32>(fileVersion, version);
+    data.append(reinterpret_cast<const char*>(version), 4);
+    data.append(toByteArray());
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size())
+        return false;
+
+    return file.commit();
+}
+
+bool GeneticProgram::load(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    const QByteArray data = file.readAll();
+    const uchar *p = reinterpret_cast<const uchar*>(data.constData());
+
+    if (data.size() < 8 || memcmp(p, programMagic, 4) != 0 || qFromLittleEndian<quint32>(p + 4) != fileVersion)
+        return false;
+
+    return fromByteArray(data.mid(8));
+}
+
+void GeneticProgram::setEvaluationMode(GeneticProgram::EvaluationMode mode)
+{
+    m_evaluationMode = mode;
+}
+
+GeneticProgram::EvaluationMode GeneticProgram::evaluationMode() const
+{
+    return m_evaluationMode;
+}
+
+void GeneticProgram::setSubtreeCache(SubtreeCache *cache)
+{
+    m_subtreeCache = cache;
+}
+
+SubtreeCache *GeneticProgram::subtreeCache() const
+{
+    return m_subtreeCache;
+}
+
+void GeneticProgram::setChannelCache(FitnessCache *cache)
+{
+    m_channelCache = cache;
+}
+
+FitnessCache *GeneticProgram::channelCache() const
+{
+    return m_channelCache;
+}
+
 qreal GeneticProgram::temperature(cv::Mat input)
 {
 
@@ -121,9 +475,14 @@ GeneticProgram &GeneticProgram::operator=(const GeneticProgram &source)
     if (this == &source)
         return *this;
 
-    // Deep copies
+    m_evaluationMode = source.m_evaluationMode;
+    m_subtreeCache = source.m_subtreeCache;
+    m_channelCache = source.m_channelCache;
+    m_simplifiedSize = source.m_simplifiedSize;
+
+    // Deep copies of the genome, the planes are shared
     for (int i = 0; i < 3; ++i) {
-        m_matrix[i] = source.m_matrix[i].clone();
+        m_matrix[i] = source.m_matrix[i];
         *(m_genome[i]) = *(source.m_genome[i]);
     }
 
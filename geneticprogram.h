@@ -2,28 +2,90 @@
 #define GENETICPROGRAM_H
 
 #include <QObject>
+#include <limits>
 #include "genetictree.h"
+#include "genetickernels.h"
+
+class SubtreeCache;
+class FitnessCache;
 
 class GeneticProgram : public QObject
 {
     Q_OBJECT
 public:
+    enum EvaluationMode {
+        ReferenceEvaluation, // Whole-plane cv::Mat per operator node
+        TiledEvaluation,     // Whole expression per tile of pixels
+        JitEvaluation        // Native code per tree, reference fallback where unsupported
+    };
+
     explicit GeneticProgram(QObject *parent = 0);
     ~GeneticProgram();
-    bool setMatrix(cv::Mat matrix);
+    bool setMatrix(cv::Mat matrix); // Converts the image to planes of this program's own
+    void setPlanes(const cv::Mat planes[3]); // Shares CV_32F planes, e.g. from splitPlanes(), nothing is copied
+    static bool splitPlanes(const cv::Mat &image, cv::Mat planes[3]); // Fresh CV_32F planes of the first three channels
     void setMaxInitialDepth(uint depth);
-    bool generateGenome();
+    bool generateGenome(GeneticRandom &random);
     cv::Mat evaluate();
+
+    // Mean absolute error against the three target planes (CV_32F), worst
+    // channel. Nothing is written out, and scoring stops as soon as one
+    // channel is certain to end above abortAbove, returning a value above it.
+    qreal score(const cv::Mat target[3], qreal abortAbove = std::numeric_limits<qreal>::infinity());
+    // Same against other input planes (CV_32F), e.g. a coarser pyramid level
+    qreal score(const cv::Mat input[3], const cv::Mat target[3], qreal abortAbove = std::numeric_limits<qreal>::infinity());
+    // Mean of the above over several pairs, three planes per pair in order.
+    // planesKey names the planes, e.g. a training window and level, for the
+    // channel cache; 0 leaves it out. Planes packed for a reduced precision
+    // by GeneticKernels::pack() are scored by the tile evaluator whatever
+    // the evaluation mode.
+    qreal score(const std::vector<cv::Mat> &inputs, const std::vector<cv::Mat> &targets,
+                qreal abortAbove = std::numeric_limits<qreal>::infinity(), quint64 planesKey = 0,
+                GeneticKernels::Precision precision = GeneticKernels::Float32);
+
+    quint64 structuralHash() const; // Same for programs with identical genomes
+    int simplifiedSize() const; // Instructions of the three channels as last scored, 0 if never scored
+
+    // Compact genome for migration: per tree an instruction count, then a
+    // byte per instruction and the value of each constant. Matrices are left
+    // out, the receiver sets its own.
+    QByteArray toByteArray() const;
+    bool fromByteArray(const QByteArray &data); // False, and nothing changed, if data is not a genome
+
+    // Program file for deployment: "GEPR", a little endian quint32 version,
+    // then toByteArray()
+    static const quint32 fileVersion = 1;
+    bool save(const QString &path) const;
+    bool load(const QString &path); // False, and nothing changed, for a foreign file or version
+
+    void setEvaluationMode(EvaluationMode mode);
+    EvaluationMode evaluationMode() const;
+    void setSubtreeCache(SubtreeCache *cache); // Tiled scoring reuses shared subtrees from it, 0 disables
+    SubtreeCache *subtreeCache() const;
+    // Channel errors keyed by the channel's simplified code. Crossover and
+    // mutation often land in code simplify() drops, and a channel whose live
+    // expression is its parent's is then not scored again. Tiled and compiled
+    // scoring only, 0 disables.
+    void setChannelCache(FitnessCache *cache);
+    FitnessCache *channelCache() const;
     qreal temperature(cv::Mat input);
 
     GeneticProgram& operator=(const GeneticProgram &source);
 
-    cv::Mat m_matrix[3];
+    cv::Mat m_matrix[3]; // CV_32F input planes, shared read only with the trees and bred children
     QList<GeneticTree*> m_genome;
-    GeneticProgram *breedWithProgram(GeneticProgram * const program);
+    GeneticProgram *breedWithProgram(GeneticProgram * const program, GeneticRandom &random);
 
 private:
+    // One pair, code already simplified; pairKey is 0 or names the pair for the channel and subtree caches
+    qreal scorePair(const cv::Mat input[3], const cv::Mat target[3], const GeneticTree::Code code[3],
+                    quint64 pairKey, qreal abortAbove, GeneticKernels::Precision precision = GeneticKernels::Float32);
+
     uint maxDepth;
+    EvaluationMode m_evaluationMode;
+    SubtreeCache *m_subtreeCache;
+    FitnessCache *m_channelCache;
+    int m_simplifiedSize;
 };
 
 #endif // GENETICPROGRAM_H
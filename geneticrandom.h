@@ -0,0 +1,63 @@
+#ifndef GENETICRANDOM_H
+#define GENETICRANDOM_H
+
+#include <QtGlobal>
+
+// Counter-based random numbers: the n-th value of a stream is the
+// SplitMix64 finaliser of key + n, so a generator is two integers, holds no
+// shared state, and split() derives independent streams without drawing
+// from the parent. Every individual gets its own stream split from its
+// island's by (generation, index), which makes a run depend on the master
+// seed only, not on which thread bred what.
+class GeneticRandom
+{
+public:
+    explicit GeneticRandom(quint64 seed = 0) : key(mix(seed)), counter(0) {}
+
+    // Independent stream for stream id, the parent is left untouched
+    GeneticRandom split(quint64 stream) const
+    {
+        return GeneticRandom(key ^ (stream * golden));
+    }
+
+    quint32 next()
+    {
+        return quint32(mix(key + ++counter * golden) >> 32);
+    }
+
+    // Uniform in [0, bound), multiply-shift instead of a biased modulo
+    int bounded(int bound)
+    {
+        Q_ASSERT(bound > 0);
+        return int((quint64(next()) * quint64(bound)) >> 32);
+    }
+
+    // Exact position in the stream, for checkpoints
+    quint64 stateKey() const { return key; }
+    quint64 stateCounter() const { return counter; }
+    static GeneticRandom fromState(quint64 key, quint64 counter)
+    {
+        GeneticRandom random;
+        random.key = key;
+        random.counter = counter;
+        return random;
+    }
+
+    static quint64 mix(quint64 x)
+    {
+        x ^= x >> 30;
+        x *= Q_UINT64_C(0xBF58476D1CE4E5B9);
+        x ^= x >> 27;
+        x *= Q_UINT64_C(0x94D049BB133111EB);
+        x ^= x >> 31;
+        return x;
+    }
+
+private:
+    static const quint64 golden = Q_UINT64_C(0x9E3779B97F4A7C15);
+
+    quint64 key;
+    quint64 counter;
+};
+
+#endif // GENETICRANDOM_H
@@ -1,133 +1,493 @@
 #include "genetictree.h"
+#include "geneticmetrics.h"
 #include <QDebug>
-#include <QDateTime>
-#include <QThread>
+#include <algorithm>
+#include <cstring>
 
 GeneticTree::GeneticTree(QObject *parent) :
     QObject(parent),
-    maxInitialDepth(100)
+    maxInitialDepth(100),
+    code(GenomeArena::Allocator<Instruction>(GenomeArena::current()))
 {
     typeStrings << "Operator" << "Matrix" << "Constant" << "Undefined";
 }
 
-void GeneticTree::generateTree()
+void GeneticTree::generateTree(GeneticRandom &random)
 {
-    //qsrand(1);
-    qsrand(QDateTime::currentDateTime().toMSecsSinceEpoch()); // set random seed
-    topItem.type = GeneticTreeItem::Operator;
-    topItem.operation = GeneticTreeItem::Operations(qrand() % 4);
-    topItem.depth = 0;
+    GeneticMetrics::Scope metrics(GeneticMetrics::TreeGrowth);
 
-    randomChildren(&topItem);
+    Instruction top;
+    top.type = GeneticTreeItem::Operator;
+    top.operation = GeneticTreeItem::Operations(random.bounded(4));
+    top.constant = 0;
 
-    if (topItem.child1->type != GeneticTreeItem::Operator)
-        Q_ASSERT(topItem.child1->type != topItem.child2->type);
+    code.clear();
+    randomChildren(code, 0, random);
+    code.push_back(top);
+
+    int child2 = code.size() - 2;
+    int child1 = subtreeStart(code, child2) - 1;
+
+    if (code[child1].type != GeneticTreeItem::Operator)
+        Q_ASSERT(code[child1].type != code[child2].type);
 }
 
 int GeneticTree::depthOfTree()
 {
-    int treeDepth = 0;
-    auto* top = &topItem;
-    depth(top, &treeDepth);
+    // Height of each pending operand, the root's height is left on the stack
+    std::vector<int> heights;
+    heights.reserve(code.size());
+
+    for (const auto& instruction : code) {
+        if (instruction.type != GeneticTreeItem::Operator) {
+            heights.push_back(1);
+            continue;
+        }
+
+        Q_ASSERT(heights.size() >= 2);
+        int height2 = heights.back();
+        heights.pop_back();
+        int height1 = heights.back();
+        heights.back() = qMax(height1, height2) + 1;
+    }
 
-    return treeDepth;
+    return heights.empty() ? 0 : heights.back();
 }
 
-void GeneticTree::depth(const GeneticTreeItem *parent, int * const initialisedDepth)
+int GeneticTree::subtreeStart(const Code &code, int end)
 {
-    if (!initialisedDepth)
-        return;
-    if (!parent)
-        return;
-    if (parent->type < 0 || parent->type > 2)
-        return;
+    // Walk back until every operand the subtree root needs has been seen
+    int pending = 1;
+    int i = end;
+
+    while (pending > 0) {
+        Q_ASSERT(i >= 0);
+        if (code[i].type == GeneticTreeItem::Operator)
+            ++pending;
+        else
+            --pending;
+        --i;
+    }
 
-    if (*initialisedDepth > 100) {
-        return;
+    return i + 1;
+}
+
+int GeneticTree::nodeDepth(const Code &code, int index)
+{
+    // Root is last, so walking backwards visits every parent before its children
+    std::vector<int> pending(1, 0);
+
+    for (int i = code.size() - 1; i >= 0; --i) {
+        int depth = pending.back();
+        pending.pop_back();
+
+        if (i == index)
+            return depth;
+
+        if (code[i].type == GeneticTreeItem::Operator) {
+            pending.push_back(depth + 1);
+            pending.push_back(depth + 1);
+        }
     }
 
-    *initialisedDepth = *initialisedDepth + 1;
+    return -1;
+}
 
-    if (parent->type != GeneticTreeItem::Operator)
-        return;
-    if (parent->child1 == 0 || parent->child2 == 0)
-        return;
+quint64 GeneticTree::structuralHash(const Code &code)
+{
+    quint64 hash = code.size();
+
+    for (const auto& instruction : code) {
+        quint64 word = instruction.type;
+
+        // Only the fields an instruction of this type uses
+        if (instruction.type == GeneticTreeItem::Operator) {
+            word |= quint64(instruction.operation) << 8;
+        } else if (instruction.type == GeneticTreeItem::Constant) {
+            quint32 bits;
+            memcpy(&bits, &instruction.constant, sizeof(bits));
+            word |= quint64(bits) << 32;
+        }
+
+        // SplitMix64 step, order sensitive
+        hash = (hash ^ word) + Q_UINT64_C(0x9E3779B97F4A7C15);
+        hash = (hash ^ (hash >> 30)) * Q_UINT64_C(0xBF58476D1CE4E5B9);
+        hash = (hash ^ (hash >> 27)) * Q_UINT64_C(0x94D049BB133111EB);
+        hash ^= hash >> 31;
+    }
+
+    return hash;
+}
+
+namespace {
+
+// What a subtree computes per pixel, as far as simplify() can tell
+struct Term {
+    enum Kind {
+        Constant,
+        Matrix,
+        Affine, // scale * matrix + offset
+        Opaque  // Anything else, kept as code
+    };
+
+    Kind kind;
+    float scale;    // Affine, or the value of a Constant
+    float offset;   // Affine
+    GeneticTree::Code code; // Opaque
+
+    bool isLeaf() const { return kind == Constant || kind == Matrix; }
+};
+
+typedef GeneticTree::GeneticTreeItem Item;
+
+GeneticTree::Instruction instruction(int type, int operation = 0, float constant = 0)
+{
+    GeneticTree::Instruction result;
+    result.type = quint8(type);
+    result.operation = quint8(operation);
+    result.constant = constant;
+    return result;
+}
+
+Term affineTerm(float scale, float offset, float tolerance)
+{
+    if (tolerance > 0) {
+        if (qAbs(scale - 1.0f) <= tolerance)
+            scale = 1.0f;
+        else if (qAbs(scale) <= tolerance)
+            scale = 0.0f;
+        if (qAbs(offset) <= tolerance)
+            offset = 0.0f;
+    }
+
+    Term term;
+    term.kind = Term::Affine;
+    term.scale = scale;
+    term.offset = offset;
+    return term;
+}
+
+void emitTerm(GeneticTree::Code &code, const Term &term)
+{
+    switch (term.kind) {
+    case Term::Constant:
+        code.push_back(instruction(Item::Constant, 0, term.scale));
+        break;
+    case Term::Matrix:
+        code.push_back(instruction(Item::Matrix));
+        break;
+    case Term::Affine:
+        code.push_back(instruction(Item::Constant, 0, term.scale));
+        code.push_back(instruction(Item::Constant, 0, term.offset));
+        code.push_back(instruction(Item::Operator, Item::Affine));
+        break;
+    case Term::Opaque:
+        code.insert(code.end(), term.code.begin(), term.code.end());
+        break;
+    }
+}
+
+// Takes over the code of an opaque operand, so a chain of operators grows
+// one buffer instead of copying it at every level
+Term opaqueTerm(Term &child1, Term &child2, int operation)
+{
+    Term term;
+    term.kind = Term::Opaque;
+
+    if (child1.kind == Term::Opaque) {
+        std::swap(term.code, child1.code);
+        emitTerm(term.code, child2);
+    } else if (child2.kind == Term::Opaque) {
+        std::swap(term.code, child2.code);
+        const auto size = term.code.size();
+        emitTerm(term.code, child1);
+        std::rotate(term.code.begin(), term.code.begin() + size, term.code.end());
+    } else {
+        emitTerm(term.code, child1);
+        emitTerm(term.code, child2);
+    }
+
+    term.code.push_back(instruction(Item::Operator, operation));
+    return term;
+}
+
+// constant o matrix, or matrix o constant when reverseOrder is false
+Term constantTerm(float constant, int operation, bool reverseOrder, float tolerance)
+{
+    switch (operation) {
+    case Item::Add:
+        return affineTerm(1.0f, constant, tolerance);
+    case Item::Multiply:
+        return affineTerm(constant, 0.0f, tolerance);
+    case Item::Subtract:
+        return reverseOrder ? affineTerm(-1.0f, constant, tolerance) : affineTerm(1.0f, -constant, tolerance);
+    default:
+        if (!reverseOrder)
+            return affineTerm(1.0f / constant, 0.0f, tolerance); // Matrix / constant multiplies by the reciprocal
+
+        Term constantLeaf;
+        constantLeaf.kind = Term::Constant;
+        constantLeaf.scale = constant;
+        Term matrixLeaf;
+        matrixLeaf.kind = Term::Matrix;
+        return opaqueTerm(constantLeaf, matrixLeaf, operation);
+    }
+}
+
+// value o matrix, or matrix o value when reverseOrder is false
+Term valueTerm(Term &value, int operation, bool reverseOrder, float tolerance)
+{
+    if (value.kind == Term::Affine) {
+        switch (operation) {
+        case Item::Add:
+            return affineTerm(value.scale + 1.0f, value.offset, tolerance);
+        case Item::Subtract:
+            return reverseOrder ? affineTerm(value.scale - 1.0f, value.offset, tolerance)
+                                : affineTerm(1.0f - value.scale, -value.offset, tolerance);
+        case Item::Multiply:
+            if (value.scale == 0.0f) // A uniform plane
+                return affineTerm(value.offset, 0.0f, tolerance);
+            break;
+        default:
+            break;
+        }
+    }
+
+    Term matrixLeaf;
+    matrixLeaf.kind = Term::Matrix;
 
-    auto* child1 = parent->child1;
-    auto* child2 = parent->child2;
+    return reverseOrder ? opaqueTerm(matrixLeaf, value, operation) : opaqueTerm(value, matrixLeaf, operation);
+}
+
+}
+
+GeneticTree::Code GeneticTree::simplify(const Code &code, float tolerance)
+{
+    std::vector<Term> stack;
+    stack.reserve(code.size());
+
+    for (const auto& current : code) {
+        if (current.type != GeneticTreeItem::Operator) {
+            Term leaf;
+            leaf.kind = (current.type == GeneticTreeItem::Constant) ? Term::Constant : Term::Matrix;
+            leaf.scale = current.constant;
+            leaf.offset = 0;
+            stack.push_back(leaf);
+            continue;
+        }
+
+        Q_ASSERT(stack.size() >= 2);
+        Term child2;
+        std::swap(child2, stack.back());
+        stack.pop_back();
+        Term &child1 = stack.back();
+
+        const int operation = current.operation;
+        Term result;
+
+        // Same combination rules as evaluateTree, so subtrees whose value is
+        // never read disappear along the way
+        if (operation == GeneticTreeItem::Affine)
+            result = affineTerm(child1.scale, child2.scale, 0);
+        else if (child1.kind == Term::Constant && child2.kind != Term::Constant)
+            result = constantTerm(child1.scale, operation, true, tolerance);
+        else if (child1.kind != Term::Constant && child2.kind == Term::Constant)
+            result = constantTerm(child2.scale, operation, false, tolerance);
+        else if (child1.kind == Term::Matrix && !child2.isLeaf())
+            result = valueTerm(child2, operation, true, tolerance);
+        else if (!child1.isLeaf() && child2.kind == Term::Matrix)
+            result = valueTerm(child1, operation, false, tolerance);
+        else if (!child1.isLeaf() && !child2.isLeaf())
+            std::swap(result, child2);
+        else
+            result = affineTerm(1.0f, 0.0f, 0); // Equal leaf types copy the matrix
+
+        std::swap(child1, result);
+    }
+
+    Q_ASSERT(stack.size() == 1);
 
-    depth(child1, initialisedDepth);
-    int tempDepth = *initialisedDepth;
-    depth(child2, initialisedDepth);
+    Code simplified;
+    simplified.reserve(code.size());
+    emitTerm(simplified, stack.back());
 
-    if (tempDepth > *initialisedDepth)
-        *initialisedDepth = tempDepth;
+    return simplified;
 }
 
 QTreeWidgetItem *GeneticTree::generateUITree()
 {
     QTreeWidgetItem *uiItem = new QTreeWidgetItem;
-    uiChildren(&topItem, uiItem);
+    GeneticTreeItem *topItem = decode(code);
+    uiChildren(topItem, uiItem);
+    delete topItem;
 
     return uiItem;
 }
 
 cv::Mat GeneticTree::evaluateTree()
 {
-    Q_ASSERT(topItem.child1 && topItem.child2);
-    evaluateChildren(&topItem);
+    GeneticMetrics::Scope metrics(GeneticMetrics::Evaluate);
+    GeneticMetrics::add(GeneticMetrics::NodesEvaluated, code.size());
+    GeneticMetrics::add(GeneticMetrics::PixelsProcessed, matrix.total());
+
+    Q_ASSERT(code.size() >= 3);
+
+    struct Value {
+        int type;
+        qreal constant;
+        cv::Mat plane;
+    };
+
+    std::vector<Value> stack;
+    stack.reserve(code.size());
+
+    for (const auto& instruction : code) {
+        if (instruction.type != GeneticTreeItem::Operator) {
+            Value value;
+            value.type = instruction.type;
+            value.constant = instruction.constant;
+            stack.push_back(value);
+            continue;
+        }
+
+        Q_ASSERT(stack.size() >= 2);
+        Value child2 = stack.back();
+        stack.pop_back();
+        Value &child1 = stack.back();
+
+        auto operation = static_cast<GeneticTreeItem::Operations>(instruction.operation);
+        cv::Mat result;
+
+        if (child1.type == GeneticTreeItem::Constant && child2.type == GeneticTreeItem::Matrix)
+            result = matrixOperation(child1.constant, operation, true);
+        else if (child1.type == GeneticTreeItem::Matrix && child2.type == GeneticTreeItem::Constant)
+            result = matrixOperation(child2.constant, operation, false);
+        else if (child1.type == GeneticTreeItem::Constant && child2.type == GeneticTreeItem::Operator)
+            result = matrixOperation(child1.constant, operation, true);
+        else if (child1.type == GeneticTreeItem::Operator && child2.type == GeneticTreeItem::Constant)
+            result = matrixOperation(child2.constant, operation, false);
+        else if (child1.type == GeneticTreeItem::Matrix && child2.type == GeneticTreeItem::Operator)
+            result = bitwiseOperation(child2.plane, operation, true);
+        else if (child1.type == GeneticTreeItem::Operator && child2.type == GeneticTreeItem::Matrix)
+            result = bitwiseOperation(child1.plane, operation, false);
+        else if (child1.type == GeneticTreeItem::Operator && child2.type == GeneticTreeItem::Operator)
+            result = child2.plane; // Second subtree was evaluated last, so its output stands
+        else if (operation == GeneticTreeItem::Affine)
+            result = matrix * child1.constant + child2.constant; // Only in simplified code
+        else
+            result = matrix; // Equal leaf types are never grown
+
+        child1.type = GeneticTreeItem::Operator;
+        child1.plane = result;
+    }
+
+    Q_ASSERT(stack.size() == 1);
+    const cv::Mat &output = stack.back().plane;
 
     Q_ASSERT(output.cols);
 
-    return output.clone();
+    // Every operation allocates its result, only a lone matrix comes back as is
+    return output.data == matrix.data ? output.clone() : output;
 }
 
 void GeneticTree::setMatrix(const QString &filePath)
 {
-    matrix = cv::imread(filePath.toStdString(), CV_LOAD_IMAGE_COLOR);
-    matrix.convertTo(matrix, CV_32F);
-    output = matrix.clone();
-    output.convertTo(output, CV_32F);
+    setMatrix(cv::imread(filePath.toStdString(), CV_LOAD_IMAGE_COLOR));
 }
 
 void GeneticTree::setMatrix(cv::Mat input)
 {
-    matrix = input.clone();
-    matrix.convertTo(matrix, CV_32F);
-    output = matrix.clone();
-    output.convertTo(output, CV_32F);
+    if (input.type() == CV_32F) {
+        matrix = input;
+        return;
+    }
+
+    // Into a plane of its own, converting into matrix could write through to
+    // planes other trees share
+    cv::Mat converted;
+    input.convertTo(converted, CV_32F);
+    matrix = converted;
 }
 
-void GeneticTree::listOfChildren(QList<const GeneticTree::GeneticTreeItem*> &list, const GeneticTreeItem* parent)
+GeneticTree::Code GeneticTree::encode(const GeneticTreeItem *item)
 {
-    list.append(parent);
+    Code code;
+    if (item)
+        encodeChildren(code, item);
 
-    if (parent->type != GeneticTreeItem::Operator)
-        return;
+    return code;
+}
 
-    listOfChildren(list, parent->child1);
-    listOfChildren(list, parent->child2);
+void GeneticTree::encodeChildren(Code &code, const GeneticTreeItem *parent)
+{
+    if (parent->type == GeneticTreeItem::Operator) {
+        Q_ASSERT(parent->child1 && parent->child2);
+        encodeChildren(code, parent->child1);
+        encodeChildren(code, parent->child2);
+    }
+
+    Instruction instruction;
+    instruction.type = parent->type;
+    instruction.operation = parent->operation;
+    instruction.constant = parent->constant;
+    code.push_back(instruction);
 }
 
-QList<const GeneticTree::GeneticTreeItem *> GeneticTree::listOfChildren()
+GeneticTree::GeneticTreeItem *GeneticTree::decode(const Code &code)
 {
-    QList<const GeneticTree::GeneticTreeItem *> childList;
-    listOfChildren(childList, &topItem);
+    std::vector<GeneticTreeItem*> stack;
+    std::vector<GeneticTreeItem*> depthOrder;
+
+    for (const auto& instruction : code) {
+        GeneticTreeItem *item = new GeneticTreeItem;
+        item->type = static_cast<GeneticTreeItem::Type>(instruction.type);
+        item->operation = static_cast<GeneticTreeItem::Operations>(instruction.operation);
+        item->constant = instruction.constant;
+        item->depth = 0;
+
+        if (item->type == GeneticTreeItem::Operator) {
+            Q_ASSERT(stack.size() >= 2);
+            item->child2 = stack.back();
+            stack.pop_back();
+            item->child1 = stack.back();
+            stack.pop_back();
+        }
+
+        stack.push_back(item);
+    }
+
+    if (stack.empty())
+        return 0;
+
+    Q_ASSERT(stack.size() == 1);
+
+    // Depths are only known once the root is in place
+    depthOrder.push_back(stack.back());
+    for (size_t i = 0; i < depthOrder.size(); ++i) {
+        GeneticTreeItem *item = depthOrder[i];
+        if (item->type != GeneticTreeItem::Operator)
+            continue;
+        item->child1->depth = item->depth + 1;
+        item->child2->depth = item->depth + 1;
+        depthOrder.push_back(item->child1);
+        depthOrder.push_back(item->child2);
+    }
 
-    return childList;
+    return stack.back();
 }
 
 GeneticTree &GeneticTree::operator=(const GeneticTree &source)
 {
+    GeneticMetrics::Scope metrics(GeneticMetrics::TreeCopy);
+
     // Check for self-assignment
     if (this == &source)
         return *this;
 
     // Shallow copy source non-pointers
     maxInitialDepth = source.maxInitialDepth;
-    topItem = source.topItem;
-    matrix = source.matrix.clone();
-    output = source.output.clone();
+    code = source.code;
+    matrix = source.matrix; // Shared, never written
     topUiItem = source.topUiItem;
 
     return *this;
@@ -147,6 +507,8 @@ GeneticTree::GeneticTreeItem::~GeneticTreeItem()
 
 GeneticTree::GeneticTreeItem &GeneticTree::GeneticTreeItem::operator=(const GeneticTree::GeneticTreeItem &source)
 {
+    GeneticMetrics::Scope metrics(GeneticMetrics::ItemCopy); // Recursive, timed once per whole copy
+
     // Check for self-assignment
     if (this == &source)
         return *this;
@@ -157,6 +519,10 @@ GeneticTree::GeneticTreeItem &GeneticTree::GeneticTreeItem::operator=(const Gene
     operation = source.operation;
     type = source.type;
 
+    // Release any previous children before replacing them
+    delete child1;
+    delete child2;
+
     // Deep copy source children
     if (source.child1 && source.child2) {
         // Allocate memory and copy
@@ -172,121 +538,102 @@ GeneticTree::GeneticTreeItem &GeneticTree::GeneticTreeItem::operator=(const Gene
     return *this;
 }
 
-GeneticTree* GeneticTree::breedWithTree(GeneticTree * const tree)
+GeneticTree* GeneticTree::breedWithTree(GeneticTree * const tree, GeneticRandom &random)
 {
-    if (tree->topItem.child1->type != GeneticTreeItem::Operator)
-        Q_ASSERT(tree->topItem.child1->type != tree->topItem.child2->type);
+    GeneticMetrics::Scope metrics(GeneticMetrics::Breed);
 
     GeneticTree *child = new GeneticTree;
     *child = *tree;
-    child->matrix = tree->matrix.clone();
-    child->output = child->matrix.clone();
 
     if (tree == this)
         return child;
 
-    if (tree->depthOfTree() < 4 || this->depthOfTree() < 4)
+    // Too few nodes to pick a crossover point below the root
+    if (tree->code.size() < 4 || code.size() < 4)
         return child;
 
-    GeneticTreeItem *randomChildOfChild = getRandomChildOfTree(child);
-    GeneticTreeItem *randomChildOfThis = getRandomChildOfTree(this, randomChildOfChild->type);
+    int randomChildOfChild = getRandomChildOfTree(child, random);
+    int randomChildOfThis = getRandomChildOfTree(this, random, child->code[randomChildOfChild].type);
 
-    *randomChildOfChild = *randomChildOfThis;
+    child->replaceSubtree(randomChildOfChild, code, randomChildOfThis);
 
     // Returning unevaluated child
     return child;
 }
 
-GeneticTree::GeneticTreeItem* GeneticTree::getRandomChildOfTree(GeneticTree * const tree, int type)
+void GeneticTree::replaceSubtree(int end, const Code &source, int sourceEnd)
 {
-    QList<const GeneticTreeItem*> childList;
+    int start = subtreeStart(code, end);
+    int sourceStart = subtreeStart(source, sourceEnd);
 
-    listOfChildren(childList, &tree->topItem);
-    removeTopItemsFromList(childList);
+    // Grow once to the exact size, regrowth would strand every outgrown
+    // buffer in the arena until it is reset
+    code.reserve(code.size() - (end + 1 - start) + (sourceEnd + 1 - sourceStart));
 
-    if (tree->depthOfTree() > 2) {
+    code.erase(code.begin() + start, code.begin() + end + 1);
+    code.insert(code.begin() + start, source.begin() + sourceStart, source.begin() + sourceEnd + 1);
+}
+
+int GeneticTree::getRandomChildOfTree(GeneticTree * const tree, GeneticRandom &random, int type)
+{
+    // Candidates are every node except the root
+    QVector<int> childList;
+    childList.reserve(tree->code.size());
+
+    int allowedType = -1;
+
+    if (tree->code.size() > 2) {
         //GeneticTreeItem::Type itemType = static_cast<GeneticTreeItem::Type>(type);
         // For now, only allow operator swapping
-        removeTypeFromList(childList, GeneticTreeItem::Constant);
-        removeTypeFromList(childList, GeneticTreeItem::Matrix);
-    } else if (type == GeneticTreeItem::Constant) {
-        removeTypeFromList(childList, GeneticTreeItem::Matrix);
-    } else if (type == GeneticTreeItem::Matrix) {
-        removeTypeFromList(childList, GeneticTreeItem::Constant);
+        allowedType = GeneticTreeItem::Operator;
+    } else if (type == GeneticTreeItem::Constant || type == GeneticTreeItem::Matrix) {
+        allowedType = type;
+    }
+
+    for (int i = 0; i < int(tree->code.size()) - 1; ++i) {
+        int childType = tree->code[i].type;
+        if (allowedType == GeneticTreeItem::Operator && childType != GeneticTreeItem::Operator)
+            continue;
+        if (allowedType == GeneticTreeItem::Constant && childType == GeneticTreeItem::Matrix)
+            continue;
+        if (allowedType == GeneticTreeItem::Matrix && childType == GeneticTreeItem::Constant)
+            continue;
+        childList.append(i);
     }
 
     if (childList.size() == 0)
         Q_ASSERT(false);
 
-    int randomNum = (qrand() % childList.size());
+    int randomNum = random.bounded(childList.size());
 
-    return const_cast<GeneticTreeItem*>(childList[randomNum]);
+    return childList[randomNum];
 }
 
-void GeneticTree::removeTopItemsFromList(QList<const GeneticTreeItem*> &list)
+void GeneticTree::mutateRandomChild(GeneticTree * const tree, GeneticRandom &random)
 {
-    QMutableListIterator<const GeneticTreeItem*> i(list);
-    while (i.hasNext()) {
-        const auto& item = i.next();
-        if (item->depth == 0)
-            i.remove();
-    }
-}
+    GeneticMetrics::Scope metrics(GeneticMetrics::Mutate);
 
-void GeneticTree::mutateRandomChild(GeneticTree * const tree)
-{
-    GeneticTreeItem *child;
-    if (tree->depthOfTree() < 4) {
+    int child;
+    if (tree->code.size() < 4) {
         return;
 //        if (qrand() % 2)
 //            child = tree->topItem.child1;
 //        else
 //            child = tree->topItem.child2;
     } else {
-        child = getRandomChildOfTree(tree);
-    }
-
-
-    child->type = GeneticTreeItem::Operator; // For now, just mutate as operator
-    child->operation = GeneticTreeItem::Operations(qrand() % 4); // Choose random operation
-    child->constant = qreal(qrand() % 1000) / 1000;
-    randomChildren(child); // Children can be any type
-}
-
-void GeneticTree::removeTypeFromList(QList<const GeneticTreeItem*> &list, GeneticTreeItem::Type type)
-{
-    QMutableListIterator<const GeneticTreeItem*> i(list);
-    while (i.hasNext()) {
-        const auto& item = i.next();
-        if (item->type == type)
-            i.remove();
+        child = getRandomChildOfTree(tree, random);
     }
-}
 
-void GeneticTree::evaluateChildren(GeneticTreeItem * const parent)
-{
-    // Q_ASSERT(parent);
-    if (parent->type != GeneticTreeItem::Operator)
-        return;
-
-    Q_ASSERT(parent->child1 && parent->child2);
+    Instruction mutation;
+    mutation.type = GeneticTreeItem::Operator; // For now, just mutate as operator
+    mutation.operation = GeneticTreeItem::Operations(random.bounded(4)); // Choose random operation
+    mutation.constant = qreal(random.bounded(1000)) / 1000;
 
-    evaluateChildren(parent->child1);
-    evaluateChildren(parent->child2);
+    Code subtree;
+    randomChildren(subtree, nodeDepth(tree->code, child), random); // Children can be any type
+    subtree.push_back(mutation);
 
-    if (parent->child1->type == GeneticTreeItem::Constant && parent->child2->type == GeneticTreeItem::Matrix)
-        matrixOperation(parent->child1->constant, parent->operation, true);
-    else if (parent->child1->type == GeneticTreeItem::Matrix && parent->child2->type == GeneticTreeItem::Constant)
-        matrixOperation(parent->child2->constant, parent->operation, false);
-    else if (parent->child1->type == GeneticTreeItem::Constant && parent->child2->type == GeneticTreeItem::Operator)
-        matrixOperation(parent->child1->constant, parent->operation, true);
-    else if (parent->child1->type == GeneticTreeItem::Operator && parent->child2->type == GeneticTreeItem::Constant)
-        matrixOperation(parent->child2->constant, parent->operation, false);
-    else if (parent->child1->type == GeneticTreeItem::Matrix && parent->child2->type == GeneticTreeItem::Operator)
-        bitwiseOperation(parent->operation, true);
-    else if (parent->child1->type == GeneticTreeItem::Operator && parent->child2->type == GeneticTreeItem::Matrix)
-        bitwiseOperation(parent->operation, false);
-    return;
+    tree->replaceSubtree(child, subtree, subtree.size() - 1);
 }
 
 void GeneticTree::uiChildren(GeneticTree::GeneticTreeItem const * parent, QTreeWidgetItem *uiParent)
@@ -328,82 +675,88 @@ QString GeneticTree::operatorToString(GeneticTree::GeneticTreeItem::Operations o
     case GeneticTreeItem::Divide: return "Divide";
     case GeneticTreeItem::Multiply: return "Multiply";
     case GeneticTreeItem::Subtract: return "Subtract";
+    case GeneticTreeItem::Affine: return "Affine";
     default: return "Undefined operation";
     }
 }
 
-void GeneticTree::randomChildren(GeneticTreeItem * parent)
+void GeneticTree::randomChildren(Code &code, uint depth, GeneticRandom &random)
 {
-    if (!parent)
-        return;
-
-    if (parent->type != GeneticTreeItem::Operator)
-        return;
+    // Appends both children of an operator at 'depth' in postfix order,
+    // the caller appends the operator itself afterwards
 
     int maxDepthExclusionCode = 2; // Default set to exclude operators
-    uint depth = parent->depth + 1;
+    uint childDepth = depth + 1;
 
-    if (depth < maxInitialDepth - 1) // Parsimony pressure
+    if (childDepth < maxInitialDepth - 1) // Parsimony pressure
         maxDepthExclusionCode = -1; // Set to no exlcusion
 
-    parent->child1 = &randomChild(maxDepthExclusionCode);
+    Instruction child1 = randomChild(random, maxDepthExclusionCode);
 
-    parent->child1->depth = depth;
+    if (child1.type == GeneticTreeItem::Operator)
+        randomChildren(code, childDepth, random);
+    code.push_back(child1);
 
-    int child1Type = parent->child1->type;
+    Instruction child2;
 
-    if (child1Type == GeneticTreeItem::Operator) {
-        randomChildren(parent->child1);
-        parent->child2 = &randomChild(maxDepthExclusionCode);
+    if (child1.type == GeneticTreeItem::Operator) {
+        child2 = randomChild(random, maxDepthExclusionCode);
 
     } else if (maxDepthExclusionCode == 2) { // Reached max depth so stop growth
-        parent->child2 = &randomChild(2);
+        child2 = randomChild(random, 2);
 
-        parent->child2->type = static_cast<GeneticTreeItem::Type>(!parent->child1->type); // Rule, cant be same type at max depth
+        child2.type = !child1.type; // Rule, cant be same type at max depth
     } else {
-        parent->child2 = &randomChild(child1Type);
+        child2 = randomChild(random, child1.type);
 
     }
-    parent->child2->depth = depth;
-    if (parent->child2->type == GeneticTreeItem::Operator)
-        randomChildren(parent->child2);
+
+    if (child2.type == GeneticTreeItem::Operator)
+        randomChildren(code, childDepth, random);
+    code.push_back(child2);
 }
 
-GeneticTree::GeneticTreeItem& GeneticTree::randomChild(int exclude)
+GeneticTree::Instruction GeneticTree::randomChild(GeneticRandom &random, int exclude)
 {
-    GeneticTreeItem *item = new GeneticTreeItem;
+    Instruction item;
 
     switch (exclude) {
-    case -1: item->type = GeneticTreeItem::Type(qrand() % 3); break; // Exclude none
-    case  0: item->type = GeneticTreeItem::Type((qrand() % 2) + 1); break; // Exclude constants
-    case  1: item->type = GeneticTreeItem::Type((qrand() % 2) * 2); break; // Exclude matrices
-    case  2: item->type = GeneticTreeItem::Type(qrand() % 2); break; // Exclude operators
+    case -1: item.type = GeneticTreeItem::Type(random.bounded(3)); break; // Exclude none
+    case  0: item.type = GeneticTreeItem::Type(random.bounded(2) + 1); break; // Exclude constants
+    case  1: item.type = GeneticTreeItem::Type(random.bounded(2) * 2); break; // Exclude matrices
+    case  2: item.type = GeneticTreeItem::Type(random.bounded(2)); break; // Exclude operators
     }
 
-    item->operation = GeneticTreeItem::Operations(qrand() % 4);
-    item->constant = qreal(qrand() % 1000) / 1000;
+    item.operation = GeneticTreeItem::Operations(random.bounded(4));
+    item.constant = qreal(random.bounded(1000)) / 1000;
 
-    return *item;
+    return item;
 }
 
-void GeneticTree::matrixOperation(qreal constant, GeneticTree::GeneticTreeItem::Operations operation, bool reverseOrder)
+cv::Mat GeneticTree::matrixOperation(qreal constant, GeneticTree::GeneticTreeItem::Operations operation, bool reverseOrder)
 {
     switch (static_cast<GeneticTreeItem::Operations>(operation)) {
-    case GeneticTreeItem::Add: output = matrix + constant; return;
-    case GeneticTreeItem::Divide: reverseOrder ? output = constant / matrix : output = matrix / constant; return;
-    case GeneticTreeItem::Multiply: output = matrix * constant; return;
-    case GeneticTreeItem::Subtract: reverseOrder ? output = constant - matrix : output = matrix - constant; return;
+    case GeneticTreeItem::Add: return matrix + constant;
+    case GeneticTreeItem::Divide: return reverseOrder ? cv::Mat(constant / matrix) : cv::Mat(matrix / constant);
+    case GeneticTreeItem::Multiply: return matrix * constant;
+    case GeneticTreeItem::Subtract: return reverseOrder ? cv::Mat(constant - matrix) : cv::Mat(matrix - constant);
     default: Q_ASSERT(false);
     }
+
+    return matrix;
 }
 
-void GeneticTree::bitwiseOperation(GeneticTree::GeneticTreeItem::Operations operation, bool reverseOrder)
+cv::Mat GeneticTree::bitwiseOperation(const cv::Mat &value, GeneticTree::GeneticTreeItem::Operations operation, bool reverseOrder)
 {
+    cv::Mat result;
+
     switch (static_cast<GeneticTreeItem::Operations>(operation)) {
-    case GeneticTreeItem::Add: output = output + matrix; return;
-    case GeneticTreeItem::Divide: reverseOrder ? cv::divide(output, matrix, output) : cv::divide(matrix, output, output); return;
-    case GeneticTreeItem::Multiply: cv::multiply(output, matrix, output); return;
-    case GeneticTreeItem::Subtract: reverseOrder ? output = output - matrix : output = matrix - output; return;
+    case GeneticTreeItem::Add: result = value + matrix; break;
+    case GeneticTreeItem::Divide: reverseOrder ? cv::divide(value, matrix, result) : cv::divide(matrix, value, result); break;
+    case GeneticTreeItem::Multiply: cv::multiply(value, matrix, result); break;
+    case GeneticTreeItem::Subtract: reverseOrder ? result = value - matrix : result = matrix - value; break;
     default: Q_ASSERT(false);
     }
+
+    return result;
 }
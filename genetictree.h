@@ -7,6 +7,10 @@
 #include <opencv/cvaux.hpp>
 #include <opencv/cxcore.hpp>
 #include <opencv/highgui.h>
+#include <vector>
+
+#include "genomearena.h"
+#include "geneticrandom.h"
 
 class GeneticTree : public QObject
 {
@@ -26,7 +30,8 @@ public:
             Add,
             Divide,
             Multiply,
-            Subtract
+            Subtract,
+            Affine // Never grown, simplify() emits it over two constants: constant1 * matrix + constant2
         };
 
         Type type;
@@ -41,39 +46,60 @@ public:
         GeneticTreeItem& operator=(const GeneticTreeItem &source);
     };
 
+    // One node of the genome in postfix (RPN) order: both operands precede
+    // their operator and the root is the last instruction.
+    struct Instruction
+    {
+        quint8 type;       // GeneticTreeItem::Type
+        quint8 operation;  // GeneticTreeItem::Operations, operators only
+        float constant;    // Constants only
+    };
+
+    // The genome of a tree is allocated from the GenomeArena current when
+    // the tree was created, any other Code lives on the heap
+    typedef std::vector<Instruction, GenomeArena::Allocator<Instruction> > Code;
+
     int depthOfTree();
-    GeneticTree *breedWithTree(GeneticTree * const tree);
-    void depth(const GeneticTreeItem *parent, int * const depth);
+    GeneticTree *breedWithTree(GeneticTree * const tree, GeneticRandom &random);
     uint maxInitialDepth;
-    void generateTree();
+    void generateTree(GeneticRandom &random);
     QTreeWidgetItem *generateUITree(); // Not to be used in console
-    cv::Mat evaluateTree();
+    cv::Mat evaluateTree(); // A plane of its own, never the matrix
     void setMatrix(const QString &filePath);
-    void setMatrix(cv::Mat input);
-    GeneticTreeItem topItem;
-    cv::Mat matrix;
-    cv::Mat output;
+    void setMatrix(cv::Mat input); // CV_32F input is shared, anything else converted once
+    Code code;
+    cv::Mat matrix; // CV_32F, read only: copies of the tree and whole populations share it
     QTreeWidgetItem topUiItem;
     QStringList typeStrings;
-    void listOfChildren(QList<const GeneticTree::GeneticTreeItem *> &list, const GeneticTreeItem* parent);
-    QList<const GeneticTree::GeneticTreeItem *> listOfChildren();
-    void mutateRandomChild(GeneticTree * const tree);
+    void mutateRandomChild(GeneticTree * const tree, GeneticRandom &random);
+
+    // Conversion between the postfix genome and the node form
+    static Code encode(const GeneticTreeItem *item);
+    static GeneticTreeItem *decode(const Code &code); // Caller takes ownership
+    static int subtreeStart(const Code &code, int end);
+    static int nodeDepth(const Code &code, int index);
+    static quint64 structuralHash(const Code &code); // Equal for identical code
+
+    // Smaller code computing the same plane, for evaluation only: dead
+    // subtrees dropped, identities removed and add/subtract chains over the
+    // matrix folded into one Affine operation. Constants within tolerance of
+    // 0 or 1 are snapped to them. The genome itself is left alone, so
+    // crossover keeps working on the original.
+    static Code simplify(const Code &code, float tolerance = 0);
 
     GeneticTree& operator=(const GeneticTree &source);
 private:
-    GeneticTreeItem &randomChild(int exclude = -1);
-    void matrixOperation(qreal constant, GeneticTreeItem::Operations operation, bool reverseOrder = true);
-    void bitwiseOperation(GeneticTreeItem::Operations operation, bool reverseOrder = true);
-    void randomChildren(GeneticTreeItem * parent);
-    void evaluateChildren(GeneticTreeItem * const parent);
+    Instruction randomChild(GeneticRandom &random, int exclude = -1);
+    cv::Mat matrixOperation(qreal constant, GeneticTreeItem::Operations operation, bool reverseOrder = true);
+    cv::Mat bitwiseOperation(const cv::Mat &value, GeneticTreeItem::Operations operation, bool reverseOrder = true);
+    void randomChildren(Code &code, uint depth, GeneticRandom &random);
     void uiChildren(GeneticTreeItem const * parent, QTreeWidgetItem * uiParent);
     QString typeToString(GeneticTreeItem::Type type);
     QString operatorToString(GeneticTree::GeneticTreeItem::Operations operation);
-    GeneticTreeItem *getRandomChildOfTree(GeneticTree * const tree, int type = -1);
-
-    void removeTypeFromList(QList<const GeneticTreeItem *> &list, GeneticTreeItem::Type type);
-    void removeTopItemsFromList(QList<const GeneticTreeItem *> &list);
+    int getRandomChildOfTree(GeneticTree * const tree, GeneticRandom &random, int type = -1);
+    void replaceSubtree(int end, const Code &source, int sourceEnd);
 
+    static void encodeChildren(Code &code, const GeneticTreeItem *parent);
 };
 
 #endif // GENETICTREE_H
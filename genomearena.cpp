@@ -0,0 +1,138 @@
+#include "genomearena.h"
+
+#include <QMutexLocker>
+#include <atomic>
+
+namespace {
+
+const size_t alignment = 16;
+
+std::atomic<quint64> nextEpoch(1); // Unique across arenas, so a reused address never matches a stale chunk
+
+struct ThreadChunk {
+    const GenomeArena *arena;
+    quint64 epoch;
+    char *cursor;
+    char *end;
+};
+
+thread_local ThreadChunk threadChunk = { 0, 0, 0, 0 };
+thread_local GenomeArena *currentArena = 0;
+
+}
+
+GenomeArena::GenomeArena(size_t chunkSize) :
+    chunkSize(qMax<size_t>(chunkSize, 1024)),
+    epoch(nextEpoch++),
+    used(0)
+{
+}
+
+GenomeArena::~GenomeArena()
+{
+    for (const auto &block : blocks)
+        delete[] block.data;
+    for (const auto &block : spare)
+        delete[] block.data;
+}
+
+void *GenomeArena::allocate(size_t bytes)
+{
+    bytes = (qMax<size_t>(bytes, 1) + alignment - 1) & ~(alignment - 1);
+
+    ThreadChunk &chunk = threadChunk;
+
+    if (chunk.arena == this && chunk.epoch == epoch && size_t(chunk.end - chunk.cursor) >= bytes) {
+        char *p = chunk.cursor;
+        chunk.cursor += bytes;
+        return p;
+    }
+
+    // Big requests get a block of their own instead of wasting a chunk
+    if (bytes > chunkSize / 4) {
+        size_t size;
+        return takeChunk(bytes, &size);
+    }
+
+    size_t size;
+    chunk.cursor = takeChunk(chunkSize, &size);
+    chunk.end = chunk.cursor + size;
+    chunk.arena = this;
+    chunk.epoch = epoch;
+
+    char *p = chunk.cursor;
+    chunk.cursor += bytes;
+    return p;
+}
+
+char *GenomeArena::takeChunk(size_t bytes, size_t *size)
+{
+    QMutexLocker locker(&mutex);
+
+    Block block = { 0, 0 };
+
+    for (size_t i = 0; i < spare.size(); ++i) {
+        if (spare[i].size >= bytes) {
+            block = spare[i];
+            spare[i] = spare.back();
+            spare.pop_back();
+            break;
+        }
+    }
+
+    if (!block.data) {
+        block.size = qMax(bytes, chunkSize);
+        block.data = new char[block.size];
+    }
+
+    blocks.push_back(block);
+    used += block.size;
+
+    *size = block.size;
+    return block.data;
+}
+
+void GenomeArena::reset()
+{
+    QMutexLocker locker(&mutex);
+
+    spare.insert(spare.end(), blocks.begin(), blocks.end());
+    blocks.clear();
+    used = 0;
+    epoch = nextEpoch++;
+}
+
+size_t GenomeArena::bytesReserved() const
+{
+    QMutexLocker locker(&mutex);
+
+    size_t total = 0;
+    for (const auto &block : blocks)
+        total += block.size;
+    for (const auto &block : spare)
+        total += block.size;
+
+    return total;
+}
+
+size_t GenomeArena::bytesUsed() const
+{
+    QMutexLocker locker(&mutex);
+    return used;
+}
+
+GenomeArena *GenomeArena::current()
+{
+    return currentArena;
+}
+
+GenomeArena::Scope::Scope(GenomeArena *arena) :
+    previous(currentArena)
+{
+    currentArena = arena;
+}
+
+GenomeArena::Scope::~Scope()
+{
+    currentArena = previous;
+}
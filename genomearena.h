@@ -0,0 +1,107 @@
+#ifndef GENOMEARENA_H
+#define GENOMEARENA_H
+
+#include <QMutex>
+#include <QtGlobal>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include "geneticmetrics.h"
+
+// Bump allocator for genome storage. Every tree bred in a generation takes
+// its code from that generation's arena, nothing is freed individually and
+// reset() releases the whole generation at once. Blocks are kept across
+// resets, so a long run settles at the peak of two generations and stops
+// calling malloc altogether.
+//
+// Threads carve private chunks out of the arena, so allocation only takes
+// the lock once per chunk.
+class GenomeArena
+{
+public:
+    explicit GenomeArena(size_t chunkSize = 64 * 1024);
+    ~GenomeArena();
+
+    void *allocate(size_t bytes);
+    void reset(); // Nothing allocated from the arena may be used afterwards
+
+    size_t bytesReserved() const; // Held in blocks, used or not
+    size_t bytesUsed() const;     // Handed out to threads since the last reset
+
+    static GenomeArena *current(); // Arena of this thread's Scope, 0 for the heap
+
+    // Routes genome allocations of the current thread to an arena while in
+    // scope. Scopes nest.
+    class Scope
+    {
+    public:
+        explicit Scope(GenomeArena *arena);
+        ~Scope();
+
+    private:
+        Q_DISABLE_COPY(Scope)
+        GenomeArena *previous;
+    };
+
+    // Standard allocator over an arena. Only containers handed current()
+    // explicitly land in it: arena memory is never freed before reset(), so
+    // temporaries built inside a Scope would pile up there. A default
+    // constructed allocator, or one without an arena, uses the heap.
+    template <typename T>
+    class Allocator
+    {
+    public:
+        typedef T value_type;
+
+        Allocator() : arena(0) {}
+        explicit Allocator(GenomeArena *arena) : arena(arena) {}
+        template <typename U>
+        Allocator(const Allocator<U> &other) : arena(other.arena) {}
+
+        T *allocate(size_t n)
+        {
+            GeneticMetrics::add(GeneticMetrics::Allocations);
+            if (arena)
+                return static_cast<T *>(arena->allocate(n * sizeof(T)));
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *p, size_t)
+        {
+            if (!arena) // Arena memory goes back on reset()
+                ::operator delete(p);
+        }
+
+        // Copies are temporaries on the heap, the source's arena may be
+        // reset long before the copy dies
+        Allocator select_on_container_copy_construction() const { return Allocator(); }
+
+        template <typename U>
+        bool operator==(const Allocator<U> &other) const { return arena == other.arena; }
+        template <typename U>
+        bool operator!=(const Allocator<U> &other) const { return arena != other.arena; }
+
+        GenomeArena *arena;
+    };
+
+private:
+    Q_DISABLE_COPY(GenomeArena)
+
+    struct Block {
+        char *data;
+        size_t size;
+    };
+
+    char *takeChunk(size_t bytes, size_t *size);
+
+    size_t chunkSize;
+    quint64 epoch; // Changes on every reset, invalidating chunks held by threads
+
+    mutable QMutex mutex;
+    std::vector<Block> blocks; // Blocks in use since the last reset
+    std::vector<Block> spare;  // Kept for reuse after a reset
+    size_t used;
+};
+
+#endif // GENOMEARENA_H
@@ -1,11 +1,361 @@
-#include <QTimer>
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QFileInfo>
+#include <QScopedPointer>
+#include <QSettings>
+#include <QStringList>
+#include <cstdio>
 
 #include "geneticengine.h"
+#include "deploypipeline.h"
 
-int main(int argc, char *argv[])
+namespace {
+
+// Settings come from the defaults, then the config file (INI, keys named
+// after the long options), then the command line
+class Options
+{
+public:
+    Options(QCommandLineParser &parser) : parser(parser) {}
+
+    bool open(QString *error)
+    {
+        if (!parser.isSet("config"))
+            return true;
+
+        const QString path = parser.value("config");
+        settings.reset(new QSettings(path, QSettings::IniFormat));
+
+        if (!QFileInfo(path).isFile() || settings->status() != QSettings::NoError) {
+            *error = "Cannot read config file " + path;
+            return false;
+        }
+        return true;
+    }
+
+    bool value(const QString &name, QString *result) const
+    {
+        if (parser.isSet(name))
+            *result = parser.value(name);
+        else if (!settings.isNull() && settings->contains(name))
+            *result = settings->value(name).toString();
+        else
+            return false;
+        return true;
+    }
+
+    // Leaves result alone for an unset option
+    bool integer(const QString &name, qint64 minimum, qint64 *result, QString *error) const
+    {
+        QString text;
+        if (!value(name, &text))
+            return true;
+
+        bool ok;
+        qint64 number = text.toLongLong(&ok);
+
+        if (!ok || number < minimum) {
+            *error = QString("Invalid %1: %2").arg(name).arg(text);
+            return false;
+        }
+
+        *result = number;
+        return true;
+    }
+
+private:
+    QCommandLineParser &parser;
+    QScopedPointer<QSettings> settings;
+};
+
+bool configure(GeneticEngine &engine, const Options &options, QString *error)
 {
-    GeneticEngine engine(argc, argv);
-    QTimer::singleShot(1, &engine, SLOT(start()));
-    return engine.exec();
+    auto value = [&](const QString &name, QString *result) {
+        return options.value(name, result);
+    };
+
+    auto integer = [&](const QString &name, qint64 minimum, qint64 *result) {
+        return options.integer(name, minimum, result, error);
+    };
+
+    value("input", &engine.inputPath);
+    value("target", &engine.targetPath);
+    value("results", &engine.resultsPath);
+    value("manifest", &engine.manifestPath);
+    value("output", &engine.outputPath);
+    value("save-program", &engine.programPath);
+    value("checkpoint", &engine.checkpointPath);
+    value("resume", &engine.resumePath);
+    value("metrics", &engine.metricsPath);
+    value("migration-socket", &engine.migrationSocketPath);
+
+    QString metricsFormat;
+    if (value("metrics-format", &metricsFormat)) {
+        if (metricsFormat == "json")
+            engine.metricsFormat = GeneticMetrics::JsonLines;
+        else if (metricsFormat == "prometheus")
+            engine.metricsFormat = GeneticMetrics::Prometheus;
+        else {
+            *error = "Invalid metrics-format: " + metricsFormat;
+            return false;
+        }
+    }
+
+    QString evaluation;
+    if (value("evaluation", &evaluation)) {
+        if (evaluation == "reference")
+            engine.evaluationMode = GeneticProgram::ReferenceEvaluation;
+        else if (evaluation == "tiled")
+            engine.evaluationMode = GeneticProgram::TiledEvaluation;
+        else if (evaluation == "jit")
+            engine.evaluationMode = GeneticProgram::JitEvaluation;
+        else {
+            *error = "Invalid evaluation: " + evaluation;
+            return false;
+        }
+    }
+
+    QString promotion;
+    if (value("promotion", &promotion)) {
+        bool ok;
+        const qreal ratio = promotion.toDouble(&ok);
+        if (!ok || !(ratio > 0 && ratio <= 1)) {
+            *error = "Invalid promotion: " + promotion;
+            return false;
+        }
+        engine.promotionRatio = ratio;
+    }
+
+    QString precisions;
+    if (value("precision", &precisions)) {
+        engine.precisions.clear();
+        for (const auto& name : precisions.split(',')) {
+            GeneticKernels::Precision precision;
+            if (!GeneticKernels::parsePrecision(name.trimmed(), &precision)) {
+                *error = "Invalid precision: " + name;
+                return false;
+            }
+            engine.precisions.append(precision);
+        }
+    }
+
+    qint64 population = engine.population;
+    qint64 breedingPoolSize = engine.breedingPoolSize;
+    qint64 generations = engine.generations;
+    qint64 initialDepth = engine.initialDepth;
+    qint64 threads = engine.threads;
+    qint64 seed = qint64(engine.seed);
+    qint64 checkpointInterval = engine.checkpointInterval;
+    qint64 windowSize = engine.windowSize;
+    qint64 batchSize = engine.batchSize;
+    qint64 patchSize = engine.patchSize;
+    qint64 rescoreInterval = engine.rescoreInterval;
+    qint64 loaderThreads = engine.loaderThreads;
+    qint64 pyramidLevels = engine.pyramidLevels;
+    qint64 downscale = engine.downscale;
+    qint64 fitnessCacheSize = engine.fitnessCacheSize;
+    qint64 subtreeCacheMegabytes = engine.subtreeCacheBudget >> 20;
+    qint64 islandCount = engine.islandCount;
+    qint64 migrationInterval = engine.migrationInterval;
+    qint64 migrantCount = engine.migrantCount;
+    qint64 processIndex = engine.processIndex;
+    qint64 processCount = engine.processCount;
+
+    if (!integer("population", 2, &population)
+            || !integer("breeding-pool", 2, &breedingPoolSize)
+            || !integer("generations", 1, &generations)
+            || !integer("initial-depth", 2, &initialDepth)
+            || !integer("threads", 0, &threads)
+            || !integer("seed", 0, &seed)
+            || !integer("checkpoint-interval", 1, &checkpointInterval)
+            || !integer("window", 1, &windowSize)
+            || !integer("batch", 0, &batchSize)
+            || !integer("patch", 0, &patchSize)
+            || !integer("rescore-interval", 1, &rescoreInterval)
+            || !integer("loader-threads", 1, &loaderThreads)
+            || !integer("pyramid-levels", 1, &pyramidLevels)
+            || !integer("downscale", 1, &downscale)
+            || !integer("fitness-cache", 0, &fitnessCacheSize)
+            || !integer("subtree-cache", 0, &subtreeCacheMegabytes)
+            || !integer("islands", 1, &islandCount)
+            || !integer("migration-interval", 0, &migrationInterval)
+            || !integer("migrants", 0, &migrantCount)
+            || !integer("process-index", 0, &processIndex)
+            || !integer("process-count", 1, &processCount))
+        return false;
+
+    if (processIndex >= processCount) {
+        *error = "The process index must be below the process count";
+        return false;
+    }
+
+    // Migrants replace the worst of the receiving pool
+    if (migrantCount > breedingPoolSize) {
+        *error = "Islands cannot send more migrants than the breeding pool holds";
+        return false;
+    }
+
+    // Breeding pairs every parent with another one, and the pool is filled
+    // from a single generation
+    if (breedingPoolSize > population) {
+        *error = "The breeding pool cannot be larger than the population";
+        return false;
+    }
+
+    if (engine.manifestPath.isEmpty() && (engine.inputPath.isEmpty() || engine.targetPath.isEmpty())) {
+        *error = "Input and target images, or a manifest, are required";
+        return false;
+    }
+
+    engine.population = int(population);
+    engine.breedingPoolSize = int(breedingPoolSize);
+    engine.generations = int(generations);
+    engine.initialDepth = int(initialDepth);
+    engine.threads = int(threads);
+    engine.seed = quint64(seed);
+    engine.checkpointInterval = int(checkpointInterval);
+    engine.windowSize = int(windowSize);
+    engine.batchSize = int(batchSize);
+    engine.patchSize = int(patchSize);
+    engine.rescoreInterval = int(rescoreInterval);
+    engine.loaderThreads = int(loaderThreads);
+    engine.pyramidLevels = int(pyramidLevels);
+    engine.downscale = int(downscale);
+    engine.fitnessCacheSize = int(fitnessCacheSize);
+    engine.subtreeCacheBudget = subtreeCacheMegabytes << 20;
+    engine.islandCount = int(islandCount);
+    engine.migrationInterval = int(migrationInterval);
+    engine.migrantCount = int(migrantCount);
+    engine.processIndex = int(processIndex);
+    engine.processCount = int(processCount);
+
+    QString gui;
+    engine.interactive = value("gui", &gui) && (gui.isEmpty() || gui == "true" || gui == "1");
+
+    return true;
 }
 
+bool configure(DeployPipeline &pipeline, const Options &options, QString *error)
+{
+    options.value("input", &pipeline.inputPath);
+    options.value("output", &pipeline.outputPath);
+
+    if (pipeline.inputPath.isEmpty() || pipeline.outputPath.isEmpty()) {
+        *error = "Deploying needs input frames and an output";
+        return false;
+    }
+
+    qint64 threads = pipeline.threads;
+    if (!options.integer("threads", 0, &threads, error))
+        return false;
+    pipeline.threads = int(threads);
+
+    QString programPath;
+    options.value("deploy", &programPath);
+    return pipeline.loadProgram(programPath, error);
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    // The application type depends on the options, so they are parsed
+    // before any exists
+    QStringList arguments;
+    for (int i = 0; i < argc; ++i)
+        arguments << QString::fromLocal8Bit(argv[i]);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Evolves a per-channel image transform from an input to a target image.");
+    const QCommandLineOption helpOption = parser.addHelpOption();
+    parser.addOptions({
+        { "config", "Read settings from an INI file.", "file" },
+        { "input", "Input image, or when deploying a directory of frames or a video.", "file" },
+        { "target", "Target image.", "file" },
+        { "manifest", "Fit every pair listed in this file, one tab separated input and target per line.", "file" },
+        { "window", "Manifest pairs scored per generation.", "count" },
+        { "batch", "Score each generation on this many random pairs, or patches, 0 uses every pair.", "count" },
+        { "patch", "Make batches of square patches this many pixels wide instead of whole pairs.", "pixels" },
+        { "rescore-interval", "Generations between full set scores of the breeding pool when batching.", "count" },
+        { "loader-threads", "Threads decoding manifest pairs ahead of use.", "count" },
+        { "downscale", "Shrink input and target by this factor, 1 keeps full resolution.", "factor" },
+        { "pyramid-levels", "Screen offspring on this many resolutions, halving each time, 1 scores at full resolution only.", "count" },
+        { "promotion", "Share of candidates, above 0 and at most 1, each pyramid level passes on to the next finer one.", "ratio" },
+        { "evaluation", "reference, tiled or jit; jit falls back to reference where unsupported.", "mode" },
+        { "fitness-cache", "Scores remembered across generations per pyramid level, 0 remembers none.", "count" },
+        { "subtree-cache", "Megabytes of shared subtree planes per island and generation in tiled mode, 0 disables.", "MiB" },
+        { "results", "Write per generation error percentiles, tree sizes, timings and the best program to this CSV file.", "file" },
+        { "output", "Write the best output image to this file, or when deploying the frames to this directory or video.", "file" },
+        { "save-program", "Save the best program to this file, for --deploy.", "file" },
+        { "deploy", "Apply the program in this file, saved or the best of a checkpoint, to --input instead of evolving.", "file" },
+        { "population", "Individuals per generation.", "count" },
+        { "breeding-pool", "Individuals kept to breed the next generation.", "count" },
+        { "generations", "Generations to run.", "count" },
+        { "initial-depth", "Maximum depth of the first generation's trees.", "depth" },
+        { "threads", "Worker threads, 0 uses every core.", "count" },
+        { "seed", "Master seed, runs on one island are reproducible for it.", "number" },
+        { "islands", "Islands in this process, each breeding its own population on its own thread.", "count" },
+        { "migration-interval", "Generations between migrations around the ring of islands, 0 never migrates.", "count" },
+        { "migrants", "Best individuals each island sends to the next one.", "count" },
+        { "migration-socket", "Trade migrants with other processes over Unix datagram sockets at this path plus .n.", "path" },
+        { "process-index", "This process's place in the ring, 0 to process-count - 1.", "index" },
+        { "process-count", "Processes started with the same settings and socket path.", "count" },
+        { "checkpoint", "Save the breeding pools to this file every few generations.", "file" },
+        { "checkpoint-interval", "Generations between checkpoints.", "count" },
+        { "resume", "Carry on from a checkpoint, with its seed.", "file" },
+        { "metrics", "Write per thread timings and counters of the hot paths to this file after every generation.", "file" },
+        { "metrics-format", "json, a line per thread and generation, or prometheus, running totals in text format.", "format" },
+        { "precision", "Fitness precision per pyramid level, finest first and comma separated, the last one repeating: "
+                       "float32, float16 or fixed16.", "list" },
+        { "gui", "Show the images while evolving." }
+    });
+
+    if (!parser.parse(arguments)) {
+        fprintf(stderr, "%s\n", qPrintable(parser.errorText()));
+        return 2;
+    }
+
+    if (parser.isSet(helpOption)) {
+        printf("%s", qPrintable(parser.helpText()));
+        return 0;
+    }
+
+    Options options(parser);
+    QString error;
+    QString deployPath;
+
+    if (!options.open(&error)) {
+        fprintf(stderr, "%s\n", qPrintable(error));
+        return 2;
+    }
+
+    if (options.value("deploy", &deployPath)) {
+        DeployPipeline pipeline;
+
+        if (!configure(pipeline, options, &error)) {
+            fprintf(stderr, "%s\n", qPrintable(error));
+            return 2;
+        }
+
+        QCoreApplication application(argc, argv);
+        return pipeline.run();
+    }
+
+    GeneticEngine engine;
+
+    if (!configure(engine, options, &error)) {
+        fprintf(stderr, "%s\n", qPrintable(error));
+        return 2;
+    }
+
+    if (!engine.interactive) {
+        QCoreApplication application(argc, argv);
+        return engine.run();
+    }
+
+    // Windows stay up until closed
+    QApplication application(argc, argv);
+    int status = engine.run();
+    return status ? status : application.exec();
+}
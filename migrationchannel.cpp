@@ -0,0 +1,118 @@
+#include "migrationchannel.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QMutexLocker>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+QueueChannel::QueueChannel(int capacity) :
+    capacity(qMax(1, capacity))
+{
+}
+
+bool QueueChannel::send(const QByteArray &packet)
+{
+    QMutexLocker locker(&mutex);
+
+    if (packets.size() >= capacity)
+        packets.removeFirst();
+    packets.append(packet);
+
+    return true;
+}
+
+QList<QByteArray> QueueChannel::receive()
+{
+    QMutexLocker locker(&mutex);
+
+    QList<QByteArray> received;
+    received.swap(packets);
+    return received;
+}
+
+SocketChannel::SocketChannel(const QString &path, bool owner) :
+    path(QFile::encodeName(path)),
+    owner(owner),
+    socket(::socket(AF_UNIX, SOCK_DGRAM, 0))
+{
+    sockaddr_un address;
+
+    if (socket < 0 || size_t(this->path.size()) >= sizeof(address.sun_path)) {
+        qWarning() << "Migration socket unavailable:" << path;
+        if (socket >= 0)
+            ::close(socket);
+        socket = -1;
+        return;
+    }
+
+    if (!owner)
+        return;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, this->path.constData(), this->path.size());
+
+    ::unlink(this->path.constData()); // Left behind by an earlier run
+
+    if (::bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        qWarning() << "Migration socket cannot bind" << path << strerror(errno);
+        ::close(socket);
+        socket = -1;
+    }
+}
+
+SocketChannel::~SocketChannel()
+{
+    if (socket < 0)
+        return;
+
+    ::close(socket);
+
+    if (owner)
+        ::unlink(path.constData());
+}
+
+bool SocketChannel::send(const QByteArray &packet)
+{
+    if (socket < 0 || packet.size() > maximumPacketSize)
+        return false;
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.constData(), path.size());
+
+    // Fails at once when the receiver is missing or its buffer is full
+    ssize_t sent = ::sendto(socket, packet.constData(), size_t(packet.size()), MSG_DONTWAIT,
+                            reinterpret_cast<sockaddr*>(&address), sizeof(address));
+
+    return sent == packet.size();
+}
+
+QList<QByteArray> SocketChannel::receive()
+{
+    QList<QByteArray> received;
+
+    if (socket < 0 || !owner)
+        return received;
+
+    QByteArray buffer(maximumPacketSize, Qt::Uninitialized);
+
+    for (;;) {
+        ssize_t size = ::recv(socket, buffer.data(), size_t(buffer.size()), MSG_DONTWAIT);
+        if (size < 0)
+            break; // EAGAIN once drained
+        received.append(QByteArray(buffer.constData(), int(size)));
+    }
+
+    return received;
+}
+
+bool SocketChannel::isValid() const
+{
+    return socket >= 0;
+}
@@ -0,0 +1,64 @@
+#ifndef MIGRATIONCHANNEL_H
+#define MIGRATIONCHANNEL_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+// Mailbox islands trade migrants through. Neither side ever waits: send()
+// drops the packet when the other end cannot take it, and receive() returns
+// whatever has arrived so far. Migration is best effort, a lost migrant only
+// slows the spread of a good genome.
+class MigrationChannel
+{
+public:
+    virtual ~MigrationChannel() {}
+
+    virtual bool send(const QByteArray &packet) = 0; // False if the packet was dropped
+    virtual QList<QByteArray> receive() = 0;         // Oldest first, possibly empty
+};
+
+// Between islands of one process. Holds at most capacity packets, a full
+// queue forgets its oldest ones.
+class QueueChannel : public MigrationChannel
+{
+public:
+    explicit QueueChannel(int capacity = 64);
+
+    bool send(const QByteArray &packet);
+    QList<QByteArray> receive();
+
+private:
+    Q_DISABLE_COPY(QueueChannel)
+
+    int capacity;
+    QMutex mutex;
+    QList<QByteArray> packets;
+};
+
+// Between processes on one machine, one Unix datagram per packet. The
+// owning end binds path and receives, the other end only sends to it. A
+// process that has not bound its socket yet simply misses what was sent.
+class SocketChannel : public MigrationChannel
+{
+public:
+    SocketChannel(const QString &path, bool owner);
+    ~SocketChannel();
+
+    bool send(const QByteArray &packet);
+    QList<QByteArray> receive();
+
+    bool isValid() const;
+
+    static const int maximumPacketSize = 256 * 1024;
+
+private:
+    Q_DISABLE_COPY(SocketChannel)
+
+    QByteArray path;
+    bool owner;
+    int socket;
+};
+
+#endif // MIGRATIONCHANNEL_H
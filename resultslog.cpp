@@ -0,0 +1,150 @@
+#include "resultslog.h"
+#include "geneticmetrics.h"
+
+#include <QMutexLocker>
+#include <algorithm>
+
+ResultsLog::ResultsLog(const QString &path, int flushInterval) :
+    file(path),
+    flushInterval(flushInterval),
+    head(0),
+    stopping(false),
+    failed(false)
+{
+    if (path.isEmpty() || !file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return; // Nothing is logged, the caller decides whether that is fatal
+
+    const QByteArray header = "island,generation,wall_ms,pool,best,p10,p25,median,p75,p90,worst,"
+                              "nodes_mean,nodes_max,depth_mean,depth_max,peak_rss_bytes,program\n";
+    failed = file.write(header) != header.size();
+
+    start(QThread::LowPriority);
+}
+
+ResultsLog::~ResultsLog()
+{
+    close();
+}
+
+bool ResultsLog::isOpen() const
+{
+    return file.isOpen();
+}
+
+void ResultsLog::writeGeneration(int island, int generation, qint64 milliseconds, const QList<GeneticEngine::GeneticData*> &bestList)
+{
+    if (!file.isOpen() || bestList.isEmpty())
+        return;
+
+    Record *record = new Record;
+    record->island = island;
+    record->generation = generation;
+    record->milliseconds = milliseconds;
+    record->pool = bestList.size();
+
+    std::vector<double> errors;
+    errors.reserve(bestList.size());
+    qint64 nodes = 0;
+    qint64 depths = 0;
+    record->nodesMax = 0;
+    record->depthMax = 0;
+
+    for (const auto& data : bestList) {
+        errors.push_back((data->error / 255) * 100);
+
+        for (const auto& tree : data->program->m_genome) {
+            const int size = int(tree->code.size());
+            const int depth = tree->depthOfTree();
+            nodes += size;
+            depths += depth;
+            record->nodesMax = qMax(record->nodesMax, size);
+            record->depthMax = qMax(record->depthMax, depth);
+        }
+    }
+
+    // Nearest rank, NaN errors from broken programs sort last
+    std::sort(errors.begin(), errors.end(), [](double a, double b) {
+        return a < b || (a == a && b != b);
+    });
+
+    const double ranks[7] = { 0, 0.1, 0.25, 0.5, 0.75, 0.9, 1 };
+    for (int i = 0; i < 7; ++i)
+        record->errors[i] = errors[size_t(ranks[i] * (errors.size() - 1) + 0.5)];
+
+    const int trees = bestList.size() * bestList.at(0)->program->m_genome.size();
+    record->nodesMean = double(nodes) / trees;
+    record->depthMean = double(depths) / trees;
+    record->program = bestList.at(0)->program->toByteArray().toBase64();
+    record->peakResident = GeneticMetrics::peakResidentBytes();
+
+    record->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+}
+
+bool ResultsLog::close()
+{
+    if (isRunning()) {
+        {
+            QMutexLocker locker(&mutex);
+            stopping = true;
+            wake.wakeOne();
+        }
+        wait();
+    }
+
+    if (file.isOpen())
+        file.close();
+
+    return !failed;
+}
+
+void ResultsLog::run()
+{
+    for (;;) {
+        QMutexLocker locker(&mutex);
+        if (!stopping)
+            wake.wait(&mutex, flushInterval);
+        const bool last = stopping;
+        locker.unlock();
+
+        writePending();
+
+        if (last)
+            return;
+    }
+}
+
+void ResultsLog::writePending()
+{
+    Record *record = head.exchange(0, std::memory_order_acquire);
+    if (!record)
+        return;
+
+    GeneticMetrics::Scope metrics(GeneticMetrics::LogWrite);
+
+    // Taken newest first, written oldest first
+    std::vector<Record*> records;
+    for (; record; record = record->next)
+        records.push_back(record);
+    std::reverse(records.begin(), records.end());
+
+    QByteArray batch;
+    for (const auto& pending : records) {
+        QByteArray line = QByteArray::number(pending->island) + ',' + QByteArray::number(pending->generation)
+                + ',' + QByteArray::number(pending->milliseconds) + ',' + QByteArray::number(pending->pool);
+
+        for (const auto& error : pending->errors)
+            line += ',' + QByteArray::number(error, 'g', 8);
+
+        line += ',' + QByteArray::number(pending->nodesMean, 'g', 6) + ',' + QByteArray::number(pending->nodesMax)
+                + ',' + QByteArray::number(pending->depthMean, 'g', 6) + ',' + QByteArray::number(pending->depthMax)
+                + ',' + QByteArray::number(pending->peakResident) + ',' + pending->program + '\n';
+
+        batch += line;
+        delete pending;
+    }
+
+    if (file.write(batch) != batch.size() || !file.flush())
+        failed = true;
+}
@@ -0,0 +1,75 @@
+#ifndef RESULTSLOG_H
+#define RESULTSLOG_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <atomic>
+#include <vector>
+
+#include "geneticengine.h"
+
+// Per generation results as CSV, a row per island and generation:
+//
+//   island,generation,wall_ms,pool,best,p10,p25,median,p75,p90,worst,
+//   nodes_mean,nodes_max,depth_mean,depth_max,peak_rss_bytes,program
+//
+// Errors are percent of full scale over the breeding pool, the only
+// individuals scored exactly. Tree statistics cover every tree in the
+// pool, peak_rss_bytes is the process's high water mark so far, and
+// program is the best one's GeneticProgram::toByteArray() in base64.
+//
+// Islands summarise their generation on their own thread and push it onto
+// a lock-free queue. A thread of the log's own formats and writes whatever
+// has piled up every flushInterval milliseconds, so neither disk nor
+// formatting ever holds up breeding.
+class ResultsLog : public QThread
+{
+public:
+    explicit ResultsLog(const QString &path, int flushInterval = 500); // Stays closed for an empty path
+    ~ResultsLog(); // Writes what is queued
+
+    bool isOpen() const;
+
+    // Any thread, copies what it needs from bestList, best first
+    void writeGeneration(int island, int generation, qint64 milliseconds, const QList<GeneticEngine::GeneticData*> &bestList);
+
+    // Writes what is queued and stops. False if any write failed. Nothing
+    // may be queued afterwards.
+    bool close();
+
+protected:
+    void run();
+
+private:
+    Q_DISABLE_COPY(ResultsLog)
+
+    struct Record {
+        Record *next;
+        int island;
+        int generation;
+        qint64 milliseconds;
+        int pool;
+        double errors[7]; // Best, p10, p25, median, p75, p90, worst
+        double nodesMean;
+        int nodesMax;
+        double depthMean;
+        int depthMax;
+        quint64 peakResident;
+        QByteArray program;
+    };
+
+    void writePending();
+
+    QFile file;
+    const int flushInterval;
+    std::atomic<Record*> head; // Newest first, producers only ever push
+    QMutex mutex; // Only for waking the writer, never taken by producers
+    QWaitCondition wake;
+    bool stopping;
+    bool failed;
+};
+
+#endif // RESULTSLOG_H
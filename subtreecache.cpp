@@ -0,0 +1,152 @@
+#include "subtreecache.h"
+#include "tileevaluator.h"
+#include "geneticmetrics.h"
+
+#include <QMutexLocker>
+#include <cstring>
+
+typedef GeneticTree::GeneticTreeItem Item;
+
+uint qHash(const SubtreeCache::Key &key, uint seed)
+{
+    const quint64 hash = key.hash ^ key.planesKey;
+    return uint(hash ^ (hash >> 32)) ^ qHash(quintptr(key.matrix), seed) ^ uint(key.count);
+}
+
+static quint64 mix(quint64 x)
+{
+    x += Q_UINT64_C(0x9E3779B97F4A7C15);
+    x = (x ^ (x >> 30)) * Q_UINT64_C(0xBF58476D1CE4E5B9);
+    x = (x ^ (x >> 27)) * Q_UINT64_C(0x94D049BB133111EB);
+    return x ^ (x >> 31);
+}
+
+SubtreeCache::SubtreeCache(qint64 byteBudget, int minimumSize) :
+    byteBudget(byteBudget),
+    minimumSize(minimumSize),
+    bytesHeld(0),
+    hits(0),
+    misses(0),
+    instructionsSaved(0)
+{
+}
+
+void SubtreeCache::plan(const GeneticTree::Code &code, const float *matrix, int count, quint64 planesKey,
+                        std::vector<int> &cachedEnd, std::vector<const float*> &cachedPlane)
+{
+    const int size = int(code.size());
+
+    // Hash and first instruction of every subtree, bottom up
+    std::vector<quint64> hashes(size);
+    std::vector<int> starts(size);
+    std::vector<int> pending;
+    pending.reserve(size);
+
+    for (int i = 0; i < size; ++i) {
+        const auto& instruction = code[i];
+
+        if (instruction.type != Item::Operator) {
+            quint32 bits = 0;
+            if (instruction.type == Item::Constant)
+                memcpy(&bits, &instruction.constant, sizeof(bits));
+            hashes[i] = mix((quint64(bits) << 8) | instruction.type);
+            starts[i] = i;
+        } else {
+            int child2 = pending.back();
+            pending.pop_back();
+            int child1 = pending.back();
+            pending.pop_back();
+            hashes[i] = mix(mix(hashes[child1] ^ (quint64(instruction.operation) << 56)) + hashes[child2]);
+            starts[i] = starts[child1];
+        }
+
+        pending.push_back(i);
+    }
+
+    // Top down, so the largest cached subtree wins and its branches are never looked at
+    std::vector<int> nodes(1, size - 1);
+    const qint64 planeBytes = qint64(count) * sizeof(float);
+
+    while (!nodes.empty()) {
+        int end = nodes.back();
+        nodes.pop_back();
+
+        if (code[end].type != Item::Operator)
+            continue;
+
+        const int start = starts[end];
+        const int length = end - start + 1;
+
+        if (length >= minimumSize) {
+            Key key = { hashes[end], matrix, count, planesKey };
+            QSharedPointer<std::vector<float> > plane;
+
+            {
+                QMutexLocker locker(&mutex);
+                Entry &entry = entries[key];
+
+                if (entry.plane) {
+                    ++hits;
+                    GeneticMetrics::add(GeneticMetrics::SubtreeCacheHits);
+                    instructionsSaved += length;
+                    plane = entry.plane;
+                } else {
+                    ++misses;
+                    GeneticMetrics::add(GeneticMetrics::SubtreeCacheMisses);
+                    ++entry.sightings;
+
+                    // Seen before and affordable, so this thread computes the plane for everyone
+                    if (entry.sightings >= 2 && !entry.pending && bytesHeld + planeBytes <= byteBudget) {
+                        entry.pending = true;
+                        bytesHeld += planeBytes;
+                        locker.unlock();
+
+                        plane = QSharedPointer<std::vector<float> >(new std::vector<float>(count));
+                        GeneticTree::Code subtree(code.begin() + start, code.begin() + end + 1);
+                        TileEvaluator().evaluate(subtree, matrix, plane->data(), count);
+
+                        locker.relock();
+                        Entry &stored = entries[key];
+                        stored.plane = plane;
+                        stored.pending = false;
+                    }
+                }
+            }
+
+            if (plane) {
+                cachedEnd[start] = end;
+                cachedPlane[start] = plane->data();
+                continue;
+            }
+        }
+
+        nodes.push_back(end - 1);          // Second operand
+        nodes.push_back(starts[end - 1] - 1); // First operand
+    }
+}
+
+void SubtreeCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    entries.clear();
+    bytesHeld = 0;
+}
+
+SubtreeCache::Stats SubtreeCache::stats() const
+{
+    QMutexLocker locker(&mutex);
+
+    Stats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.instructionsSaved = instructionsSaved;
+    stats.bytesHeld = bytesHeld;
+    stats.planes = 0;
+
+    for (const auto& entry : entries) {
+        if (entry.plane)
+            ++stats.planes;
+    }
+
+    return stats;
+}
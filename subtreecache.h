@@ -0,0 +1,82 @@
+#ifndef SUBTREECACHE_H
+#define SUBTREECACHE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <vector>
+
+#include "genetictree.h"
+
+// Evaluated planes of subtrees that recur across the population. Crossover
+// copies whole subtrees between parents, so after a few generations many
+// trees share large identical branches over the same input. A subtree is
+// materialised the second time it is seen, while the byte budget allows,
+// and later trees read the plane instead of recomputing the branch.
+//
+// Planes are only valid for the input they were computed over. The key
+// holds its address and a planes key naming it, because addresses alone
+// are not enough: training windows are freed and re-decoded, and a new
+// window can land where an old one was. The input planes that programs
+// share are not freed, but windows are. Planes are dropped by clear()
+// once per generation.
+class SubtreeCache
+{
+public:
+    explicit SubtreeCache(qint64 byteBudget = qint64(256) << 20, int minimumSize = 7);
+
+    struct Stats {
+        quint64 hits;
+        quint64 misses;
+        quint64 instructionsSaved; // Per pixel, summed over hits
+        qint64 bytesHeld;
+        int planes;
+    };
+
+    // Marks the largest cached subtrees of code over matrix[0, count): for a
+    // subtree [start, end] served from a plane, cachedEnd[start] = end and
+    // cachedPlane[start] points at the plane. Both vectors are code sized.
+    // planesKey names what matrix holds, e.g. a training window, level and
+    // channel, since a freed window's address is soon reused by another one.
+    void plan(const GeneticTree::Code &code, const float *matrix, int count, quint64 planesKey,
+              std::vector<int> &cachedEnd, std::vector<const float*> &cachedPlane);
+
+    void clear(); // Not while anything is being evaluated, planned pointers die with it
+    Stats stats() const;
+
+    qint64 byteBudget;
+    int minimumSize; // Instructions, smaller subtrees are cheaper to recompute than to look up
+
+private:
+    Q_DISABLE_COPY(SubtreeCache)
+
+    struct Key {
+        quint64 hash;
+        const float *matrix;
+        int count;
+        quint64 planesKey;
+
+        bool operator==(const Key &other) const
+        {
+            return hash == other.hash && matrix == other.matrix && count == other.count && planesKey == other.planesKey;
+        }
+    };
+
+    friend uint qHash(const Key &key, uint seed);
+
+    struct Entry {
+        Entry() : sightings(0), pending(false) {}
+        int sightings;
+        bool pending; // Being evaluated by some thread
+        QSharedPointer<std::vector<float> > plane;
+    };
+
+    mutable QMutex mutex;
+    QHash<Key, Entry> entries;
+    qint64 bytesHeld;
+    quint64 hits;
+    quint64 misses;
+    quint64 instructionsSaved;
+};
+
+#endif // SUBTREECACHE_H
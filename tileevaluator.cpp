@@ -0,0 +1,240 @@
+#include "tileevaluator.h"
+#include "subtreecache.h"
+
+#include <cstring>
+
+typedef GeneticTree::GeneticTreeItem Item;
+
+TileEvaluator::TileEvaluator(int tileSize, const GeneticKernels::Table *kernels) :
+    tileSize(tileSize),
+    kernels(kernels ? kernels : &GeneticKernels::table()),
+    subtreeCache(0),
+    planesKey(0)
+{
+}
+
+int TileEvaluator::stackDepth(const GeneticTree::Code &code)
+{
+    int depth = 0;
+    int maxDepth = 0;
+
+    for (const auto& instruction : code) {
+        depth += (instruction.type == Item::Operator) ? -1 : 1;
+        maxDepth = qMax(maxDepth, depth);
+    }
+
+    return maxDepth;
+}
+
+template <typename T>
+TileEvaluator::Workspace<T>::Workspace(const GeneticTree::Code &code, int tileSize) :
+    bufferCount(stackDepth(code))
+{
+    buffers.resize(size_t(bufferCount) * tileSize);
+    stack.reserve(bufferCount);
+    freeBuffers.reserve(bufferCount);
+}
+
+cv::Mat TileEvaluator::evaluate(const GeneticTree::Code &code, const cv::Mat &matrix) const
+{
+    Q_ASSERT(matrix.type() == CV_32F);
+
+    cv::Mat output(matrix.rows, matrix.cols, CV_32F);
+    Workspace<float> workspace(code, tileSize);
+
+    int rows = matrix.rows;
+    int cols = matrix.cols;
+
+    if (matrix.isContinuous()) {
+        cols *= rows;
+        rows = 1;
+    }
+
+    for (int row = 0; row < rows; ++row) {
+        const float *in = matrix.ptr<float>(row);
+        float *out = output.ptr<float>(row);
+
+        for (int offset = 0; offset < cols; offset += tileSize)
+            evaluateTile(*kernels, code, in + offset, out + offset, offset, qMin(tileSize, cols - offset), workspace);
+    }
+
+    return output;
+}
+
+void TileEvaluator::evaluate(const GeneticTree::Code &code, const float *matrix, float *output, int count) const
+{
+    Workspace<float> workspace(code, tileSize);
+    planCachedSubtrees(code, matrix, count, workspace);
+
+    for (int offset = 0; offset < count; offset += tileSize)
+        evaluateTile(*kernels, code, matrix + offset, output + offset, offset, qMin(tileSize, count - offset), workspace);
+}
+
+double TileEvaluator::sumAbsoluteError(const GeneticTree::Code &code, const float *matrix, const float *target, int count, double abortAbove) const
+{
+    Workspace<float> workspace(code, tileSize);
+    planCachedSubtrees(code, matrix, count, workspace);
+
+    std::vector<float> output(qMin(tileSize, count));
+    double sum = 0;
+
+    for (int offset = 0; offset < count && sum <= abortAbove; offset += tileSize) {
+        int n = qMin(tileSize, count - offset);
+        evaluateTile(*kernels, code, matrix + offset, output.data(), offset, n, workspace);
+        sum += kernels->absoluteError(output.data(), target + offset, n);
+    }
+
+    return sum;
+}
+
+double TileEvaluator::sumAbsoluteErrorHalf(const GeneticTree::Code &code, const quint16 *matrix, const quint16 *target, int count, double abortAbove) const
+{
+    Workspace<float> workspace(code, tileSize);
+
+    // Only the tile being worked on is ever widened
+    const int tile = qMin(tileSize, count);
+    std::vector<float> input(tile);
+    std::vector<float> expected(tile);
+    std::vector<float> output(tile);
+    double sum = 0;
+
+    for (int offset = 0; offset < count && sum <= abortAbove; offset += tileSize) {
+        int n = qMin(tileSize, count - offset);
+        kernels->halfToFloat(input.data(), matrix + offset, n);
+        kernels->halfToFloat(expected.data(), target + offset, n);
+        evaluateTile(*kernels, code, input.data(), output.data(), offset, n, workspace);
+        sum += kernels->absoluteError(output.data(), expected.data(), n);
+    }
+
+    return sum;
+}
+
+double TileEvaluator::sumAbsoluteErrorFixed(const GeneticTree::Code &code, const qint16 *matrix, const qint16 *target, int count, double abortAbove) const
+{
+    const GeneticKernels::FixedTable &fixedKernels = GeneticKernels::fixedTable();
+    Workspace<qint16> workspace(code, tileSize);
+
+    std::vector<qint16> output(qMin(tileSize, count));
+    double sum = 0;
+
+    for (int offset = 0; offset < count && sum <= abortAbove; offset += tileSize) {
+        int n = qMin(tileSize, count - offset);
+        evaluateTile(fixedKernels, code, matrix + offset, output.data(), offset, n, workspace);
+        sum += fixedKernels.absoluteError(output.data(), target + offset, n);
+    }
+
+    return sum;
+}
+
+void TileEvaluator::planCachedSubtrees(const GeneticTree::Code &code, const float *matrix, int count, Workspace<float> &workspace) const
+{
+    if (!subtreeCache)
+        return;
+
+    workspace.cachedEnd.assign(code.size(), -1);
+    workspace.cachedPlane.assign(code.size(), 0);
+    subtreeCache->plan(code, matrix, count, planesKey, workspace.cachedEnd, workspace.cachedPlane);
+}
+
+template <typename T, typename Table>
+void TileEvaluator::evaluateTile(const Table &kernels, const GeneticTree::Code &code, const T *matrix, T *output, int offset, int count,
+                                 Workspace<T> &workspace) const
+{
+    auto& stack = workspace.stack;
+    auto& freeBuffers = workspace.freeBuffers;
+
+    stack.clear();
+    freeBuffers.clear();
+    for (int i = workspace.bufferCount - 1; i >= 0; --i)
+        freeBuffers.push_back(i);
+
+    auto acquire = [&]() {
+        Q_ASSERT(!freeBuffers.empty());
+        int buffer = freeBuffers.back();
+        freeBuffers.pop_back();
+        return buffer;
+    };
+
+    // Results are computed in place, except over a cached plane
+    auto writable = [&](const Operand<T> &operand) {
+        return operand.buffer >= 0 ? operand.buffer : acquire();
+    };
+
+    const bool cached = !workspace.cachedEnd.empty();
+
+    for (int i = 0; i < int(code.size()); ++i) {
+        const auto& instruction = code[i];
+
+        // A cached subtree is read straight from its plane, in no buffer of ours
+        if (cached && workspace.cachedEnd[i] >= 0) {
+            Operand<T> value;
+            value.type = Item::Operator;
+            value.constant = 0;
+            value.data = const_cast<T*>(workspace.cachedPlane[i] + offset);
+            value.buffer = -1;
+            stack.push_back(value);
+            i = workspace.cachedEnd[i];
+            continue;
+        }
+
+        if (instruction.type != Item::Operator) {
+            Operand<T> leaf;
+            leaf.type = instruction.type;
+            leaf.constant = instruction.constant;
+            leaf.data = const_cast<T*>(matrix);
+            leaf.buffer = -1;
+            stack.push_back(leaf);
+            continue;
+        }
+
+        Q_ASSERT(stack.size() >= 2);
+        Operand<T> child2 = stack.back();
+        stack.pop_back();
+        Operand<T> &child1 = stack.back();
+
+        const int operation = qMin(int(instruction.operation), int(Item::Subtract)); // Affine has its own kernel
+        const auto& constantKernels = kernels.constantKernels[operation];
+        const auto& valueKernels = kernels.valueKernels[operation];
+        int buffer;
+
+        // Same combination rules as GeneticTree::evaluateTree, computed in place
+        if (instruction.operation == Item::Affine) {
+            Q_ASSERT(child1.type == Item::Constant && child2.type == Item::Constant);
+            buffer = acquire();
+            kernels.affine(&workspace.buffers[buffer * tileSize], matrix, child1.constant, child2.constant, count);
+        } else if (child1.type == Item::Constant && child2.type == Item::Matrix) {
+            buffer = acquire();
+            constantKernels[true](&workspace.buffers[buffer * tileSize], matrix, child1.constant, count);
+        } else if (child1.type == Item::Matrix && child2.type == Item::Constant) {
+            buffer = acquire();
+            constantKernels[false](&workspace.buffers[buffer * tileSize], matrix, child2.constant, count);
+        } else if (child1.type == Item::Constant && child2.type == Item::Operator) {
+            buffer = writable(child2);
+            constantKernels[true](&workspace.buffers[buffer * tileSize], matrix, child1.constant, count);
+        } else if (child1.type == Item::Operator && child2.type == Item::Constant) {
+            buffer = writable(child1);
+            constantKernels[false](&workspace.buffers[buffer * tileSize], matrix, child2.constant, count);
+        } else if (child1.type == Item::Matrix && child2.type == Item::Operator) {
+            buffer = writable(child2);
+            valueKernels[true](&workspace.buffers[buffer * tileSize], child2.data, matrix, count);
+        } else if (child1.type == Item::Operator && child2.type == Item::Matrix) {
+            buffer = writable(child1);
+            valueKernels[false](&workspace.buffers[buffer * tileSize], child1.data, matrix, count);
+        } else if (child1.type == Item::Operator && child2.type == Item::Operator) {
+            if (child1.buffer >= 0)
+                freeBuffers.push_back(child1.buffer);
+            child1 = child2; // Cached planes pass through without a copy
+            continue;
+        } else {
+            buffer = acquire();
+            memcpy(&workspace.buffers[buffer * tileSize], matrix, count * sizeof(T));
+        }
+
+        child1.type = Item::Operator;
+        child1.data = &workspace.buffers[buffer * tileSize];
+        child1.buffer = buffer;
+    }
+
+    Q_ASSERT(stack.size() == 1 && stack.back().type == Item::Operator);
+    memcpy(output, stack.back().data, count * sizeof(T));
+}
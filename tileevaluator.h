@@ -0,0 +1,69 @@
+#ifndef TILEEVALUATOR_H
+#define TILEEVALUATOR_H
+
+#include "genetictree.h"
+#include "genetickernels.h"
+
+#include <limits>
+
+class SubtreeCache;
+
+// Evaluates a postfix genome one tile of pixels at a time, so every
+// intermediate lives in a small scratch buffer instead of a full-size
+// cv::Mat per operator node.
+class TileEvaluator
+{
+public:
+    explicit TileEvaluator(int tileSize = 512, const GeneticKernels::Table *kernels = 0);
+
+    cv::Mat evaluate(const GeneticTree::Code &code, const cv::Mat &matrix) const;
+    void evaluate(const GeneticTree::Code &code, const float *matrix, float *output, int count) const;
+
+    // Sum of |target - tree(matrix)| without writing an output. Stops at the
+    // first tile that takes the sum past abortAbove and returns that partial sum.
+    double sumAbsoluteError(const GeneticTree::Code &code, const float *matrix, const float *target, int count,
+                            double abortAbove = std::numeric_limits<double>::infinity()) const;
+    // The same over planes packed by GeneticKernels::pack(). Half floats are
+    // widened a tile at a time and computed in float, fixed point stays in
+    // fixed point. Neither reads the subtree cache.
+    double sumAbsoluteErrorHalf(const GeneticTree::Code &code, const quint16 *matrix, const quint16 *target, int count,
+                                double abortAbove = std::numeric_limits<double>::infinity()) const;
+    double sumAbsoluteErrorFixed(const GeneticTree::Code &code, const qint16 *matrix, const qint16 *target, int count,
+                                 double abortAbove = std::numeric_limits<double>::infinity()) const;
+
+    static int stackDepth(const GeneticTree::Code &code);
+
+    int tileSize; // Pixels per tile, 512 keeps a depth-20 stack within L1/L2
+    const GeneticKernels::Table *kernels;
+    SubtreeCache *subtreeCache; // Shared subtrees are read from here when set, pointer inputs only
+    quint64 planesKey; // Names the input planes for the subtree cache, see SubtreeCache::plan()
+
+private:
+    // T is float, or qint16 for fixed point
+    template <typename T>
+    struct Operand {
+        int type;
+        float constant;
+        T *data;
+        int buffer;
+    };
+
+    template <typename T>
+    struct Workspace {
+        Workspace(const GeneticTree::Code &code, int tileSize);
+        std::vector<T> buffers;
+        std::vector<Operand<T> > stack;
+        std::vector<int> freeBuffers;
+        int bufferCount;
+        std::vector<int> cachedEnd; // Per instruction, last index of a subtree served from a plane, or -1
+        std::vector<const T*> cachedPlane;
+    };
+
+    void planCachedSubtrees(const GeneticTree::Code &code, const float *matrix, int count, Workspace<float> &workspace) const;
+    // Table is GeneticKernels::Table for float, GeneticKernels::FixedTable for qint16
+    template <typename T, typename Table>
+    void evaluateTile(const Table &kernels, const GeneticTree::Code &code, const T *matrix, T *output, int offset, int count,
+                      Workspace<T> &workspace) const;
+};
+
+#endif // TILEEVALUATOR_H
@@ -0,0 +1,475 @@
+#include "trainingset.h"
+#include "geneticrandom.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QTextStream>
+#include <QThread>
+#include <opencv2/opencv.hpp>
+
+class TrainingSet::Loader : public QThread
+{
+public:
+    explicit Loader(TrainingSet *set) : set(set) {}
+
+protected:
+    void run() { set->loaderLoop(); }
+
+private:
+    TrainingSet *set;
+};
+
+TrainingSet::TrainingSet() :
+    windowSize(8),
+    batchSize(0),
+    patchSize(0),
+    seed(0),
+    pyramidLevels(3),
+    downscale(1),
+    loaderThreads(2),
+    prefetch(2),
+    useClock(0),
+    stopping(false)
+{
+}
+
+TrainingSet::~TrainingSet()
+{
+    stopLoaders();
+}
+
+bool TrainingSet::setPair(const cv::Mat &input, const cv::Mat &target)
+{
+    std::vector<std::vector<Level> > pairs(1);
+    if (!preparePair(input, target, &pairs[0]))
+        return false;
+
+    stopLoaders();
+    inputs.clear();
+    targets.clear();
+    windows.clear();
+    tasks.clear();
+    failure.clear();
+
+    memoryInput = input;
+    memoryTarget = target;
+    single = assemble(0, pairs);
+
+    return true;
+}
+
+bool TrainingSet::loadManifest(const QString &path, QString *error)
+{
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        *error = "Cannot read manifest " + path;
+        return false;
+    }
+
+    const QDir directory = QFileInfo(path).absoluteDir();
+    QStringList newInputs;
+    QStringList newTargets;
+    QTextStream in(&file);
+
+    for (int line = 1; !in.atEnd(); ++line) {
+        const QString text = in.readLine().trimmed();
+
+        if (text.isEmpty() || text.startsWith("#"))
+            continue;
+
+        const QStringList fields = text.split('\t', QString::SkipEmptyParts);
+
+        if (fields.size() != 2) {
+            *error = QString("%1:%2: expected an input and a target separated by a tab").arg(path).arg(line);
+            return false;
+        }
+
+        const QString input = directory.absoluteFilePath(fields.at(0).trimmed());
+        const QString target = directory.absoluteFilePath(fields.at(1).trimmed());
+
+        // Missing files are caught now rather than generations into the run
+        if (!QFileInfo(input).isFile() || !QFileInfo(target).isFile()) {
+            *error = QString("%1:%2: no such image").arg(path).arg(line);
+            return false;
+        }
+
+        newInputs.append(input);
+        newTargets.append(target);
+    }
+
+    if (newInputs.isEmpty()) {
+        *error = "Manifest " + path + " lists no pairs";
+        return false;
+    }
+
+    stopLoaders();
+
+    inputs = newInputs;
+    targets = newTargets;
+    memoryInput = cv::Mat();
+    memoryTarget = cv::Mat();
+    single.clear();
+    windows.clear();
+    tasks.clear();
+    failure.clear();
+
+    return true;
+}
+
+int TrainingSet::pairCount() const
+{
+    return single ? 1 : inputs.size();
+}
+
+int TrainingSet::windowCount() const
+{
+    if (single)
+        return 1;
+
+    const int size = qMax(1, windowSize);
+    return (inputs.size() + size - 1) / size;
+}
+
+bool TrainingSet::isSampled() const
+{
+    return batchSize > 0 && (patchSize > 0 || batchSize < pairCount());
+}
+
+QString TrainingSet::inputPath(int pair) const
+{
+    return inputs.value(pair);
+}
+
+QString TrainingSet::targetPath(int pair) const
+{
+    return targets.value(pair);
+}
+
+TrainingSet::WindowPointer TrainingSet::window(int generation)
+{
+    if (isSampled()) {
+        const int key = windowCount() + generation;
+        return fetch(key, key + qMax(0, prefetch) + 1);
+    }
+
+    if (single)
+        return single;
+
+    const int index = generation % windowCount();
+    return fetch(index, index + qMin(qMax(0, prefetch), windowCount() - 1) + 1);
+}
+
+TrainingSet::WindowPointer TrainingSet::fullWindow(int index)
+{
+    Q_ASSERT(index >= 0 && index < windowCount());
+
+    if (single)
+        return single;
+
+    // Full windows are read in order, so the following ones are worth decoding
+    return fetch(index, qMin(windowCount(), index + qMax(0, prefetch) + 1));
+}
+
+TrainingSet::WindowPointer TrainingSet::fetch(int key, int prefetchEnd)
+{
+    const int count = windowCount();
+
+    QMutexLocker locker(&mutex);
+
+    if (loaders.isEmpty())
+        startLoaders();
+
+    // The window in use goes to the front of the queue, the ones after it
+    // follow. Full windows wrap around, batches do not.
+    for (int next = key; next < prefetchEnd; ++next)
+        request(key < count ? next % count : next);
+
+    windows[key].lastUse = ++useClock;
+    evict(key);
+
+    for (;;) {
+        auto it = windows.find(key);
+
+        if (it == windows.end())
+            request(key); // Evicted by another island while this one waited
+        else if (it.value().ready || it.value().failed)
+            return it.value().ready;
+        else
+            windowReady.wait(&mutex);
+    }
+}
+
+QString TrainingSet::error() const
+{
+    QMutexLocker locker(&mutex);
+    return failure;
+}
+
+GeneticKernels::Precision TrainingSet::precision(int level) const
+{
+    if (precisions.empty())
+        return GeneticKernels::Float32;
+
+    return precisions[size_t(qMin(level, int(precisions.size()) - 1))];
+}
+
+cv::Mat TrainingSet::downscaled(const cv::Mat &image, int factor)
+{
+    if (factor <= 1)
+        return image;
+
+    cv::Mat result;
+    cv::resize(image, result, cv::Size(image.cols / factor, image.rows / factor));
+    return result;
+}
+
+bool TrainingSet::preparePair(const cv::Mat &input, const cv::Mat &target, std::vector<Level> *levels) const
+{
+    if (input.empty() || target.empty() || input.size() != target.size() || input.channels() != 3 || target.channels() != 3)
+        return false;
+
+    cv::Mat levelInput;
+    cv::Mat levelTarget;
+    downscaled(input, downscale).convertTo(levelInput, CV_32F);
+    downscaled(target, downscale).convertTo(levelTarget, CV_32F);
+
+    levels->clear();
+    for (int level = 0; level < qMax(1, pyramidLevels); ++level) {
+        if (level > 0) {
+            if (levelInput.cols < 16 || levelInput.rows < 16)
+                break;
+            cv::pyrDown(levelInput, levelInput);
+            cv::pyrDown(levelTarget, levelTarget);
+        }
+
+        cv::Mat inputPlanes[3];
+        cv::Mat targetPlanes[3];
+        cv::split(levelInput, inputPlanes);
+        cv::split(levelTarget, targetPlanes);
+
+        Level planes;
+        planes.inputs.assign(inputPlanes, inputPlanes + 3);
+        planes.targets.assign(targetPlanes, targetPlanes + 3);
+        planes.precision = precision(level);
+
+        if (planes.precision != GeneticKernels::Float32) {
+            for (int i = 0; i < 3; ++i) {
+                planes.packedInputs.push_back(GeneticKernels::pack(inputPlanes[i], planes.precision));
+                planes.packedTargets.push_back(GeneticKernels::pack(targetPlanes[i], planes.precision));
+            }
+        }
+
+        levels->push_back(planes);
+    }
+
+    return true;
+}
+
+bool TrainingSet::decodePair(const Task &task, std::vector<Level> *levels) const
+{
+    cv::Mat input = memoryInput;
+    cv::Mat target = memoryTarget;
+
+    if (input.empty()) {
+        input = cv::imread(inputs.at(task.pair).toStdString(), CV_LOAD_IMAGE_COLOR);
+        target = cv::imread(targets.at(task.pair).toStdString(), CV_LOAD_IMAGE_COLOR);
+    }
+
+    // Patches are cut before scaling, an image smaller than a patch is used whole
+    if (patchSize > 0 && task.window >= windowCount() && !input.empty() && input.size() == target.size()) {
+        GeneticRandom random(task.patchSeed);
+        const int width = qMin(patchSize, input.cols);
+        const int height = qMin(patchSize, input.rows);
+        const cv::Rect patch(random.bounded(input.cols - width + 1), random.bounded(input.rows - height + 1), width, height);
+        input = input(patch);
+        target = target(patch);
+    }
+
+    return preparePair(input, target, levels);
+}
+
+TrainingSet::WindowPointer TrainingSet::assemble(int id, const std::vector<std::vector<Level> > &pairs) const
+{
+    Window *window = new Window;
+    window->id = id;
+    window->pairs = 0;
+
+    // Every pair must offer every level, so small images cap the pyramid
+    size_t levelCount = size_t(qMax(1, pyramidLevels));
+    for (const auto& pair : pairs) {
+        if (!pair.empty())
+            levelCount = qMin(levelCount, pair.size());
+    }
+
+    window->levels.resize(levelCount);
+
+    for (const auto& pair : pairs) {
+        if (pair.empty())
+            continue; // Unreadable, already reported
+
+        for (size_t level = 0; level < levelCount; ++level) {
+            Level &planes = window->levels[level];
+            planes.inputs.insert(planes.inputs.end(), pair[level].inputs.begin(), pair[level].inputs.end());
+            planes.targets.insert(planes.targets.end(), pair[level].targets.begin(), pair[level].targets.end());
+            planes.precision = pair[level].precision;
+            planes.packedInputs.insert(planes.packedInputs.end(), pair[level].packedInputs.begin(), pair[level].packedInputs.end());
+            planes.packedTargets.insert(planes.packedTargets.end(), pair[level].packedTargets.begin(), pair[level].packedTargets.end());
+        }
+        ++window->pairs;
+    }
+
+    if (window->pairs == 0) {
+        delete window;
+        return WindowPointer();
+    }
+
+    return WindowPointer(window);
+}
+
+void TrainingSet::request(int key)
+{
+    if (windows.contains(key))
+        return;
+
+    const int pairs = pairCount();
+    const int count = windowCount();
+    std::vector<Task> work;
+
+    if (key < count) {
+        const int size = qMax(1, windowSize);
+
+        for (int pair = key * size; pair < qMin(pairs, (key + 1) * size); ++pair) {
+            Task task = { key, int(work.size()), pair, 0 };
+            work.push_back(task);
+        }
+    } else {
+        GeneticRandom random = GeneticRandom(seed).split(quint64(key - count));
+
+        if (patchSize > 0) {
+            // Patches may come from the same pair more than once
+            for (int i = 0; i < batchSize; ++i) {
+                Task task = { key, i, random.bounded(pairs), 0 };
+                task.patchSeed = quint64(random.next()) << 32;
+                task.patchSeed |= random.next();
+                work.push_back(task);
+            }
+        } else {
+            // Partial Fisher-Yates, pairs are drawn without replacement
+            std::vector<int> order(pairs);
+            for (int i = 0; i < pairs; ++i)
+                order[i] = i;
+
+            for (int i = 0; i < qMin(batchSize, pairs); ++i) {
+                std::swap(order[i], order[i + random.bounded(pairs - i)]);
+                Task task = { key, i, order[i], 0 };
+                work.push_back(task);
+            }
+        }
+    }
+
+    Entry &entry = windows[key];
+    entry.remaining = int(work.size());
+    entry.pairs.resize(work.size());
+    entry.failed = false;
+    entry.lastUse = useClock;
+
+    tasks.insert(tasks.end(), work.begin(), work.end());
+    workAvailable.wakeAll();
+}
+
+void TrainingSet::evict(int current)
+{
+    // Islands keep their own reference, dropping a window here only stops
+    // it from being handed out again
+    const int capacity = 2 * (qMax(0, prefetch) + 1);
+
+    while (windows.size() > capacity) {
+        int oldest = -1;
+        quint64 oldestUse = 0;
+
+        for (auto it = windows.constBegin(); it != windows.constEnd(); ++it) {
+            if (it.key() == current || !it.value().ready)
+                continue;
+            if (oldest < 0 || it.value().lastUse < oldestUse) {
+                oldest = it.key();
+                oldestUse = it.value().lastUse;
+            }
+        }
+
+        if (oldest < 0)
+            break; // Everything else is still being decoded
+
+        windows.remove(oldest);
+    }
+}
+
+void TrainingSet::startLoaders()
+{
+    stopping = false;
+
+    for (int i = 0; i < qMax(1, loaderThreads); ++i) {
+        Loader *loader = new Loader(this);
+        loaders.append(loader);
+        loader->start();
+    }
+}
+
+void TrainingSet::stopLoaders()
+{
+    {
+        QMutexLocker locker(&mutex);
+        stopping = true;
+        workAvailable.wakeAll();
+    }
+
+    for (const auto& loader : loaders)
+        loader->wait();
+    qDeleteAll(loaders);
+    loaders.clear();
+}
+
+void TrainingSet::loaderLoop()
+{
+    QMutexLocker locker(&mutex);
+
+    for (;;) {
+        while (tasks.empty() && !stopping)
+            workAvailable.wait(&mutex);
+
+        if (stopping)
+            return;
+
+        const Task task = tasks.front();
+        tasks.pop_front();
+        locker.unlock();
+
+        std::vector<Level> levels;
+        if (!decodePair(task, &levels))
+            qWarning() << "Cannot use pair" << inputPath(task.pair) << targetPath(task.pair);
+
+        locker.relock();
+
+        auto it = windows.find(task.window);
+        if (it == windows.end() || it.value().ready)
+            continue; // Evicted meanwhile
+
+        Entry &entry = it.value();
+        entry.pairs[task.position].swap(levels);
+
+        if (--entry.remaining == 0) {
+            entry.ready = assemble(task.window, entry.pairs);
+            entry.pairs.clear(); // The window holds the planes now
+
+            if (!entry.ready) {
+                entry.failed = true;
+                if (failure.isEmpty())
+                    failure = QString("Training window %1 has no readable pair").arg(task.window);
+            }
+            windowReady.wakeAll();
+        }
+    }
+}
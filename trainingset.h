@@ -0,0 +1,140 @@
+#ifndef TRAININGSET_H
+#define TRAININGSET_H
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QWaitCondition>
+#include <deque>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "genetickernels.h"
+
+// Image pairs a transform is fitted to. Either one pair held in memory, or
+// a manifest of pairs too large to hold, streamed a window at a time. The
+// manifest is cut into windowCount() windows of windowSize pairs, and
+// generation g is scored on window g % windowCount().
+//
+// With a batch size, generation g is scored on a random batch instead:
+// batchSize pairs, or batchSize patches of patchSize pixels cut from random
+// pairs. The batch only depends on the seed and g, so every individual and
+// every island of a generation is ranked on the same one. The windows then
+// serve to score on the full set, see fullWindow().
+//
+// Loader threads decode the windows ahead of the one in use. At most a few
+// are kept, older ones are dropped once no island uses them any more.
+//
+// A manifest lists one pair per line, input then target separated by a
+// tab, relative to the manifest's directory. Empty lines and lines starting
+// with # are skipped.
+class TrainingSet
+{
+public:
+    struct Level {
+        Level() : precision(GeneticKernels::Float32) {}
+        std::vector<cv::Mat> inputs; // CV_32F planes, three per pair
+        std::vector<cv::Mat> targets;
+        GeneticKernels::Precision precision; // Unless Float32, the planes are also packed for it
+        std::vector<cv::Mat> packedInputs;
+        std::vector<cv::Mat> packedTargets;
+    };
+
+    struct Window {
+        int id; // Windows with the same id hold the same pairs
+        int pairs;
+        std::vector<Level> levels; // Full resolution first, each further level halves it
+    };
+
+    typedef QSharedPointer<const Window> WindowPointer;
+
+    TrainingSet();
+    ~TrainingSet();
+
+    // Read when the pairs are set
+    int windowSize; // Pairs per window
+    int batchSize; // Pairs or patches per generation, 0 scores whole windows in turn
+    int patchSize; // Side of the square patches batches are made of, 0 takes whole pairs
+    quint64 seed; // Batches drawn for each generation
+    int pyramidLevels;
+    int downscale;
+    int loaderThreads;
+    int prefetch; // Windows decoded ahead of the one in use
+    // Per level, finest first, the last one repeating for the coarser
+    // levels; empty leaves every level at Float32
+    std::vector<GeneticKernels::Precision> precisions;
+
+    GeneticKernels::Precision precision(int level) const;
+
+    // 8-bit BGR images of the same size, false and nothing kept otherwise
+    bool setPair(const cv::Mat &input, const cv::Mat &target);
+    bool loadManifest(const QString &path, QString *error);
+
+    int pairCount() const;
+    int windowCount() const;
+    bool isSampled() const; // Generations see less than the whole set
+    QString inputPath(int pair) const;
+    QString targetPath(int pair) const;
+
+    // Planes for a generation, waiting for them if the loaders are behind.
+    // Null, with error() set, if none of the window's pairs can be read.
+    WindowPointer window(int generation);
+    // Window index of the full set, all windowCount() of them cover every
+    // pair once, whole
+    WindowPointer fullWindow(int index);
+    QString error() const; // Why a window came back null, empty until one did
+
+    static cv::Mat downscaled(const cv::Mat &image, int factor);
+
+private:
+    Q_DISABLE_COPY(TrainingSet)
+
+    class Loader;
+    friend class Loader;
+
+    struct Task {
+        int window;
+        int position; // Within the window
+        int pair;
+        quint64 patchSeed; // Where the patch is cut once the size is known, patches only
+    };
+
+    struct Entry {
+        int remaining; // Pairs still being decoded
+        std::vector<std::vector<Level> > pairs;
+        WindowPointer ready;
+        bool failed; // No readable pair, ready stays null
+        quint64 lastUse;
+    };
+
+    bool preparePair(const cv::Mat &input, const cv::Mat &target, std::vector<Level> *levels) const;
+    bool decodePair(const Task &task, std::vector<Level> *levels) const;
+    WindowPointer assemble(int id, const std::vector<std::vector<Level> > &pairs) const; // Null without a readable pair
+    WindowPointer fetch(int key, int prefetchEnd);
+    void request(int key);
+    void evict(int current);
+    void startLoaders();
+    void stopLoaders();
+    void loaderLoop();
+
+    QStringList inputs;
+    QStringList targets;
+    cv::Mat memoryInput; // The pair given to setPair()
+    cv::Mat memoryTarget;
+    WindowPointer single; // All of it, prepared once
+
+    mutable QMutex mutex;
+    QWaitCondition workAvailable;
+    QWaitCondition windowReady;
+    std::deque<Task> tasks;
+    QHash<int, Entry> windows; // Keys below windowCount() are full windows, then one batch per generation
+    quint64 useClock;
+    bool stopping;
+    QString failure;
+    QList<Loader*> loaders;
+};
+
+#endif // TRAININGSET_H
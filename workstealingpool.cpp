@@ -0,0 +1,181 @@
+#include "workstealingpool.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+static thread_local int currentQueue = 0;
+
+class WorkStealingPool::Worker : public QThread
+{
+public:
+    Worker(WorkStealingPool *pool, int queue) :
+        pool(pool),
+        queue(queue)
+    {
+    }
+
+protected:
+    void run() Q_DECL_OVERRIDE
+    {
+        currentQueue = queue;
+        pool->workerLoop(queue);
+    }
+
+private:
+    WorkStealingPool *pool;
+    int queue;
+};
+
+WorkStealingPool::WorkStealingPool(int threads) :
+    pendingChunks(0),
+    stopping(false)
+{
+    if (threads <= 0)
+        threads = QThread::idealThreadCount();
+    threads = qMax(1, threads);
+
+    for (int i = 0; i < threads; ++i)
+        queues.push_back(new Queue);
+
+    // The calling thread is worker 0, so only threads - 1 are started
+    for (int i = 1; i < threads; ++i) {
+        Worker *worker = new Worker(this, i);
+        workers.append(worker);
+        worker->start();
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        QMutexLocker locker(&sleepMutex);
+        stopping = true;
+        wake.wakeAll();
+    }
+
+    for (Worker *worker : workers) {
+        worker->wait();
+        delete worker;
+    }
+
+    for (Queue *queue : queues)
+        delete queue;
+}
+
+int WorkStealingPool::workerCount() const
+{
+    return int(queues.size());
+}
+
+int WorkStealingPool::currentWorker()
+{
+    return currentQueue;
+}
+
+void WorkStealingPool::parallelFor(int count, const std::function<void(int)> &task)
+{
+    if (count <= 0)
+        return;
+
+    const int queueCount = int(queues.size());
+
+    if (queueCount == 1) {
+        for (int i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+
+    // A few chunks per worker leaves room for stealing without much overhead
+    const int chunkSize = qMax(1, count / (queueCount * 4));
+    const int chunkCount = (count + chunkSize - 1) / chunkSize;
+
+    Job job;
+    job.task = &task;
+    job.remaining.store(chunkCount);
+    job.finished = false;
+
+    const int home = currentQueue;
+    for (int c = 0; c < chunkCount; ++c) {
+        Chunk chunk;
+        chunk.job = &job;
+        chunk.begin = c * chunkSize;
+        chunk.end = qMin(count, chunk.begin + chunkSize);
+
+        Queue *queue = queues[(home + c) % queueCount];
+        QMutexLocker locker(&queue->mutex);
+        queue->chunks.push_back(chunk);
+    }
+
+    {
+        QMutexLocker locker(&sleepMutex);
+        pendingChunks.fetchAndAddOrdered(chunkCount);
+        wake.wakeAll();
+    }
+
+    // Help until this job's chunks have all been claimed
+    while (job.remaining.load() > 0 && runChunk(home)) {
+    }
+
+    QMutexLocker locker(&job.mutex);
+    while (!job.finished)
+        job.done.wait(&job.mutex);
+}
+
+bool WorkStealingPool::runChunk(int queue)
+{
+    const int queueCount = int(queues.size());
+    Chunk chunk;
+    bool found = false;
+
+    // Own work newest first, stolen work oldest first
+    {
+        Queue *own = queues[queue];
+        QMutexLocker locker(&own->mutex);
+        if (!own->chunks.empty()) {
+            chunk = own->chunks.back();
+            own->chunks.pop_back();
+            found = true;
+        }
+    }
+
+    for (int i = 1; !found && i < queueCount; ++i) {
+        Queue *victim = queues[(queue + i) % queueCount];
+        QMutexLocker locker(&victim->mutex);
+        if (!victim->chunks.empty()) {
+            chunk = victim->chunks.front();
+            victim->chunks.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found)
+        return false;
+
+    pendingChunks.fetchAndAddOrdered(-1);
+
+    for (int i = chunk.begin; i < chunk.end; ++i)
+        (*chunk.job->task)(i);
+
+    Job *job = chunk.job;
+    if (job->remaining.fetchAndAddOrdered(-1) == 1) {
+        QMutexLocker locker(&job->mutex);
+        job->finished = true;
+        job->done.wakeAll();
+    }
+
+    return true;
+}
+
+void WorkStealingPool::workerLoop(int queue)
+{
+    forever {
+        if (runChunk(queue))
+            continue;
+
+        QMutexLocker locker(&sleepMutex);
+        if (stopping)
+            return;
+        if (pendingChunks.load() == 0)
+            wake.wait(&sleepMutex);
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <functional>
+#include <deque>
+#include <vector>
+
+// Fixed set of worker threads, each with its own deque of index ranges.
+// A worker pops from the back of its own deque and steals from the front
+// of the others when it runs dry, so uneven individuals (deep trees next to
+// shallow ones) balance out without a central queue.
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(int threads = 0); // 0 uses every core
+    ~WorkStealingPool();
+
+    int workerCount() const; // Background workers plus the calling thread
+
+    // Runs task(i) for every i in [0, count) and returns once all are done.
+    // The calling thread works too, and several threads may call this at once.
+    void parallelFor(int count, const std::function<void(int)> &task);
+
+    static int currentWorker(); // 0 for threads outside the pool
+
+private:
+    Q_DISABLE_COPY(WorkStealingPool)
+
+    class Worker;
+    friend class Worker;
+
+    struct Job {
+        const std::function<void(int)> *task;
+        QAtomicInt remaining; // Chunks not yet finished
+        QMutex mutex;
+        QWaitCondition done;
+        bool finished;
+    };
+
+    struct Chunk {
+        Job *job;
+        int begin;
+        int end;
+    };
+
+    struct Queue {
+        QMutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    bool runChunk(int queue);
+    void workerLoop(int queue);
+
+    std::vector<Queue*> queues; // Queue 0 is shared by threads outside the pool
+    QList<Worker*> workers;
+
+    QAtomicInt pendingChunks;
+    QMutex sleepMutex;
+    QWaitCondition wake;
+    bool stopping;
+};
+
+#endif // WORKSTEALINGPOOL_H